@@ -4,20 +4,657 @@
 // Wikipedia's NFA/DFA articles
 //
 // g++ -std=c++2a nfa.cc && ./a.out
+// ./a.out --serve <socket> runs the shared pattern server (see PatternServer)
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <regex>
 #include <set>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// Optional competitor baselines for baselineTests().  Each is opted into with a define and
+// skipped if its header isn't installed, e.g.
+//   g++ -O3 -std=c++2a -DWITH_RE2 -DWITH_PCRE2 -DWITH_HYPERSCAN nfa.cc -lre2 -lpcre2-8 -lhs
+#if defined(WITH_RE2) && __has_include(<re2/re2.h>)
+#include <re2/re2.h>
+#define HAVE_RE2 1
+#elif defined(WITH_RE2)
+#warning "WITH_RE2 is set but re2/re2.h was not found; skipping the RE2 baseline"
+#endif
+
+#if defined(WITH_PCRE2) && __has_include(<pcre2.h>)
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#define HAVE_PCRE2 1
+#elif defined(WITH_PCRE2)
+#warning "WITH_PCRE2 is set but pcre2.h was not found; skipping the PCRE2 baseline"
+#endif
+
+#if defined(WITH_HYPERSCAN) && __has_include(<hs/hs.h>)
+#include <hs/hs.h>
+#define HAVE_HYPERSCAN 1
+#elif defined(WITH_HYPERSCAN)
+#warning "WITH_HYPERSCAN is set but hs/hs.h was not found; skipping the Hyperscan baseline"
+#endif
+
+// Bytes owned by an automaton or engine, broken down by what they hold.  Node-based
+// containers are estimated from their element counts plus typical per-node overhead.
+struct MemoryUsage {
+    size_t states = 0;  // per-state containers / offsets
+    size_t edges = 0;   // transitions
+    size_t accept = 0;  // match sets / flags
+    size_t tables = 0;  // lookup tables derived from the automaton
+    size_t code = 0;    // generated native code
+    size_t caches = 0;  // lazily filled caches
+    size_t scratch = 0; // worst-case working memory of one match
+
+    size_t total() const {
+        return states + edges + accept + tables + code + caches + scratch;
+    }
+
+    MemoryUsage& operator+=(MemoryUsage const& other) {
+        states += other.states;
+        edges += other.edges;
+        accept += other.accept;
+        tables += other.tables;
+        code += other.code;
+        caches += other.caches;
+        scratch += other.scratch;
+        return *this;
+    }
+
+    void print(std::ostream& out) const {
+        out << "states: " << states << " edges: " << edges << " accept: " << accept
+            << " tables: " << tables << " code: " << code << " caches: " << caches
+            << " scratch: " << scratch << " total: " << total() << std::endl;
+    }
+
+    // red-black tree node: color + three pointers, then the value
+    static constexpr size_t kTreeNodeOverhead = 4 * sizeof(void*);
+    // singly linked hash node plus its bucket slot
+    static constexpr size_t kHashNodeOverhead = 2 * sizeof(void*);
+
+    template <typename T>
+    static size_t bytes(std::vector<T> const& v) {
+        return v.capacity() * sizeof(T);
+    }
+
+    template <typename K, typename V>
+    static size_t bytes(std::map<K, V> const& m) {
+        return m.size() * (kTreeNodeOverhead + sizeof(std::pair<K const, V>));
+    }
+
+    template <typename K>
+    static size_t bytes(std::set<K> const& s) {
+        return s.size() * (kTreeNodeOverhead + sizeof(K));
+    }
+
+    template <typename K>
+    static size_t bytes(std::unordered_set<K> const& s) {
+        return s.bucket_count() * sizeof(void*) + s.size() * (sizeof(void*) + sizeof(K));
+    }
+};
+
+// Chrome trace-event recorder for compile phases and batch stages; load the JSON from
+// writeJson() into Perfetto or chrome://tracing.  Spans come from TraceScope.  Each thread
+// appends to its own buffer, and with tracing off a scope costs one relaxed load.
+struct Tracer {
+    struct Event {
+        char const* name; // string literals only: events keep the pointer
+        char const* category;
+        int64_t startNs;  // since start()
+        int64_t durationNs;
+    };
+
+    static Tracer& global() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    // Drop anything recorded so far and start recording
+    void start() {
+        std::lock_guard lock(m_mutex);
+        for (auto& buffer : m_buffers) {
+            std::lock_guard bufferLock(buffer->mutex);
+            buffer->events.clear();
+        }
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        m_epochNs.store(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(), std::memory_order_relaxed);
+        m_enabled.store(true, std::memory_order_release);
+    }
+
+    void stop() {
+        m_enabled.store(false, std::memory_order_relaxed);
+    }
+
+    bool enabled() const {
+        return m_enabled.load(std::memory_order_acquire);
+    }
+
+    // read by recording threads while start() may be resetting it, hence atomic
+    std::chrono::steady_clock::time_point epoch() const {
+        auto ns = std::chrono::nanoseconds(m_epochNs.load(std::memory_order_relaxed));
+        return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(ns));
+    }
+
+    void record(Event const& event) {
+        auto& buffer = threadBuffer();
+        std::lock_guard lock(buffer.mutex); // only contended by writeJson()
+        buffer.events.push_back(event);
+    }
+
+    size_t numEvents() const {
+        std::lock_guard lock(m_mutex);
+        size_t n = 0;
+        for (auto& buffer : m_buffers) {
+            std::lock_guard bufferLock(buffer->mutex);
+            n += buffer->events.size();
+        }
+        return n;
+    }
+
+    // Complete ("X") events, one track per thread
+    void writeJson(std::ostream& out) const {
+        std::lock_guard lock(m_mutex);
+        out << "{\"traceEvents\":[";
+        char const* separator = "";
+        for (auto& buffer : m_buffers) {
+            std::lock_guard bufferLock(buffer->mutex);
+            for (auto& event : buffer->events) {
+                out << separator << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category
+                    << "\",\"ph\":\"X\",\"ts\":" << event.startNs / 1000.0 << ",\"dur\":" << event.durationNs / 1000.0
+                    << ",\"pid\":" << getpid() << ",\"tid\":" << buffer->tid << "}";
+                separator = ",\n";
+            }
+        }
+        out << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+    }
+
+private:
+    struct Buffer {
+        int tid;
+        std::mutex mutex;
+        std::vector<Event> events;
+    };
+
+    // registered on the thread's first event and kept for writeJson() after it exits
+    Buffer& threadBuffer() {
+        thread_local std::shared_ptr<Buffer> buffer;
+        if (!buffer) {
+            std::lock_guard lock(m_mutex);
+            buffer = std::make_shared<Buffer>();
+            buffer->tid = m_buffers.size() + 1;
+            m_buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    std::atomic<bool> m_enabled{false};
+    std::atomic<int64_t> m_epochNs{0}; // steady_clock time of start()
+    mutable std::mutex m_mutex;
+    std::vector<std::shared_ptr<Buffer>> m_buffers;
+};
+
+// Span from construction to destruction, recorded if tracing is on (cf. Benchmark's TimedScope)
+struct TraceScope {
+    explicit TraceScope(char const* name, char const* category = "compile") : m_name(name), m_category(category) {
+        if (Tracer::global().enabled()) {
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    TraceScope(TraceScope const&) = delete;
+    TraceScope& operator=(TraceScope const&) = delete;
+
+    ~TraceScope() {
+        if (!m_start) {
+            return;
+        }
+        auto& tracer = Tracer::global();
+        auto stop = std::chrono::steady_clock::now();
+        tracer.record({m_name, m_category,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(*m_start - tracer.epoch()).count(),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(stop - *m_start).count()});
+    }
+
+private:
+    char const* m_name;
+    char const* m_category;
+    std::optional<std::chrono::steady_clock::time_point> m_start;
+};
+
+// SIMD kernels, each compiled once per instruction set tier with target attributes so a
+// single build runs everywhere.  kernels() starts out as the best tier the CPU supports;
+// tests can forceTier() any supported tier to exercise every variant on one machine.
+enum class SimdTier { Scalar, SSE42, AVX2, AVX512, Count };
+
+inline char const* tierName(SimdTier tier) {
+    static char const* const names[] = {"scalar", "sse4.2", "avx2", "avx512"};
+    return names[int(tier)];
+}
+
+// Set of byte values.  m_rows is the form the vector kernels look bytes up in with two
+// shuffles: c is in the set iff bit (c >> 4) & 7 of m_rows[c >> 7][c & 15] is set.
+struct ByteSet {
+    void insert(unsigned char c) {
+        m_bits[c >> 6] |= uint64_t(1) << (c & 63);
+        m_rows[c >> 7][c & 15] |= 1 << ((c >> 4) & 7);
+    }
+
+    bool contains(unsigned char c) const {
+        return m_bits[c >> 6] >> (c & 63) & 1;
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (auto word : m_bits) {
+            n += __builtin_popcountll(word);
+        }
+        return n;
+    }
+
+    uint64_t m_bits[4] = {};
+    alignas(16) uint8_t m_rows[2][16] = {};
+};
+
+// Position masks for ShortVerifier.  Byte c falls in buckets lowBuckets[c & 15] &
+// highBuckets[c >> 4]; shape k accepts a string of length n if bit n of lengths[k] is set
+// and, for every i < n, byte i's buckets meet masks[k][i].
+struct ShapeSet {
+    static constexpr size_t kMaxLength = 32;
+    static constexpr size_t kMaxShapes = 8;
+
+    alignas(16) uint8_t lowBuckets[16] = {};
+    alignas(16) uint8_t highBuckets[16] = {};
+    alignas(32) uint8_t masks[kMaxShapes][kMaxLength] = {};
+    uint64_t lengths[kMaxShapes] = {};
+    size_t numShapes = 0;
+    size_t maxLength = 0;
+};
+
+struct Kernels {
+    SimdTier tier;
+    // index of the first occurrence of byte in data, or len
+    size_t (*findByte)(char const* data, size_t len, char byte);
+    // index of the first byte that is not in set, or len
+    size_t (*findNotInSet)(char const* data, size_t len, ByteSet const& set);
+    // whether some shape in set accepts data
+    bool (*matchShapes)(ShapeSet const& set, char const* data, size_t len);
+};
+
+inline size_t findByteScalar(char const* data, size_t len, char byte) {
+    for (size_t i = 0; i < len; ++i) {
+        if (data[i] == byte) {
+            return i;
+        }
+    }
+    return len;
+}
+
+inline size_t findNotInSetScalar(char const* data, size_t len, ByteSet const& set) {
+    for (size_t i = 0; i < len; ++i) {
+        if (!set.contains(data[i])) {
+            return i;
+        }
+    }
+    return len;
+}
+
+inline bool matchShapesScalar(ShapeSet const& set, char const* data, size_t len) {
+    if (len > set.maxLength) {
+        return false;
+    }
+    for (size_t k = 0; k < set.numShapes; ++k) {
+        if (!(set.lengths[k] >> len & 1)) {
+            continue;
+        }
+        size_t i = 0;
+        while (i < len && (set.lowBuckets[data[i] & 15] & set.highBuckets[uint8_t(data[i]) >> 4] & set.masks[k][i])) {
+            ++i;
+        }
+        if (i == len) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.2")))
+inline size_t findByteSSE42(char const* data, size_t len, char byte) {
+    __m128i needle = _mm_set1_epi8(byte);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((__m128i const*)(data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findByteScalar(data + i, len - i, byte);
+}
+
+__attribute__((target("avx2")))
+inline size_t findByteAVX2(char const* data, size_t len, char byte) {
+    __m256i needle = _mm256_set1_epi8(byte);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((__m256i const*)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findByteSSE42(data + i, len - i, byte);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline size_t findByteAVX512(char const* data, size_t len, char byte) {
+    __m512i needle = _mm512_set1_epi8(byte);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i chunk = _mm512_loadu_si512((void const*)(data + i));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(chunk, needle);
+        if (mask) {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+    return i + findByteAVX2(data + i, len - i, byte);
+}
+
+// The findNotInSet kernels shuffle the low nibble of each byte into both halves of
+// ByteSet::m_rows, pick a half by the high nibble's top bit, and test the row bit for the
+// high nibble's other three.
+__attribute__((target("sse4.2")))
+inline size_t findNotInSetSSE42(char const* data, size_t len, ByteSet const& set) {
+    __m128i const rowsLow = _mm_load_si128((__m128i const*)set.m_rows[0]);
+    __m128i const rowsHigh = _mm_load_si128((__m128i const*)set.m_rows[1]);
+    __m128i const bitOf = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i const upper = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i const nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((__m128i const*)(data + i));
+        __m128i lo = _mm_and_si128(chunk, nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(chunk, 4), nibble);
+        __m128i rows = _mm_blendv_epi8(_mm_shuffle_epi8(rowsLow, lo), _mm_shuffle_epi8(rowsHigh, lo), _mm_shuffle_epi8(upper, hi));
+        __m128i hits = _mm_and_si128(rows, _mm_shuffle_epi8(bitOf, hi));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128()));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findNotInSetScalar(data + i, len - i, set);
+}
+
+__attribute__((target("avx2")))
+inline size_t findNotInSetAVX2(char const* data, size_t len, ByteSet const& set) {
+    __m256i const rowsLow = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*)set.m_rows[0]));
+    __m256i const rowsHigh = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*)set.m_rows[1]));
+    __m256i const bitOf = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                           1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m256i const upper = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, -1,
+                                           0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i const nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((__m256i const*)(data + i));
+        __m256i lo = _mm256_and_si256(chunk, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble);
+        __m256i rows = _mm256_blendv_epi8(_mm256_shuffle_epi8(rowsLow, lo), _mm256_shuffle_epi8(rowsHigh, lo), _mm256_shuffle_epi8(upper, hi));
+        __m256i hits = _mm256_and_si256(rows, _mm256_shuffle_epi8(bitOf, hi));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hits, _mm256_setzero_si256()));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findNotInSetSSE42(data + i, len - i, set);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline size_t findNotInSetAVX512(char const* data, size_t len, ByteSet const& set) {
+    __m512i const rowsLow = _mm512_maskz_broadcast_i32x4(0xffff, _mm_load_si128((__m128i const*)set.m_rows[0]));
+    __m512i const rowsHigh = _mm512_maskz_broadcast_i32x4(0xffff, _mm_load_si128((__m128i const*)set.m_rows[1]));
+    __m512i const bitOf = _mm512_maskz_broadcast_i32x4(0xffff, _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128));
+    __m512i const nibble = _mm512_set1_epi8(0x0f);
+    __m512i const eight = _mm512_set1_epi8(8);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i chunk = _mm512_loadu_si512((void const*)(data + i));
+        __m512i lo = _mm512_and_si512(chunk, nibble);
+        __m512i hi = _mm512_and_si512(_mm512_srli_epi16(chunk, 4), nibble);
+        __m512i rows = _mm512_mask_blend_epi8(_mm512_cmpge_epu8_mask(hi, eight), _mm512_shuffle_epi8(rowsLow, lo), _mm512_shuffle_epi8(rowsHigh, lo));
+        uint64_t mask = _mm512_testn_epi8_mask(rows, _mm512_shuffle_epi8(bitOf, hi));
+        if (mask) {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+    return i + findNotInSetAVX2(data + i, len - i, set);
+}
+
+// The matchShapes kernels copy the input into a zeroed buffer (so short strings never read
+// past their end), bucket every byte with the same nibble shuffles as findNotInSet, and then
+// need one AND, compare and movemask per shape and vector; lanes past len are masked off.
+__attribute__((target("sse4.2")))
+inline bool matchShapesSSE42(ShapeSet const& set, char const* data, size_t len) {
+    if (len > set.maxLength) {
+        return false;
+    }
+    alignas(16) char buf[ShapeSet::kMaxLength] = {};
+    memcpy(buf, data, len);
+    __m128i const low = _mm_load_si128((__m128i const*)set.lowBuckets);
+    __m128i const high = _mm_load_si128((__m128i const*)set.highBuckets);
+    __m128i const nibble = _mm_set1_epi8(0x0f);
+    size_t const vectors = (set.maxLength + 15) / 16;
+    __m128i buckets[ShapeSet::kMaxLength / 16];
+    for (size_t v = 0; v < vectors; ++v) {
+        __m128i chunk = _mm_load_si128((__m128i const*)(buf + 16 * v));
+        buckets[v] = _mm_and_si128(_mm_shuffle_epi8(low, _mm_and_si128(chunk, nibble)),
+                                   _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(chunk, 4), nibble)));
+    }
+    uint64_t const lanes = (uint64_t(1) << len) - 1;
+    for (size_t k = 0; k < set.numShapes; ++k) {
+        uint64_t misses = 0;
+        for (size_t v = 0; v < vectors; ++v) {
+            __m128i hits = _mm_and_si128(buckets[v], _mm_load_si128((__m128i const*)(set.masks[k] + 16 * v)));
+            misses |= uint64_t(_mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128()))) << 16 * v;
+        }
+        if ((set.lengths[k] >> len & 1) && !(misses & lanes)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((target("avx2")))
+inline bool matchShapesAVX2(ShapeSet const& set, char const* data, size_t len) {
+    if (len > set.maxLength) {
+        return false;
+    }
+    alignas(32) char buf[ShapeSet::kMaxLength] = {};
+    memcpy(buf, data, len);
+    __m256i const low = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*)set.lowBuckets));
+    __m256i const high = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*)set.highBuckets));
+    __m256i const nibble = _mm256_set1_epi8(0x0f);
+    __m256i chunk = _mm256_load_si256((__m256i const*)buf);
+    __m256i buckets = _mm256_and_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(chunk, nibble)),
+                                       _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble)));
+    uint64_t const lanes = (uint64_t(1) << len) - 1;
+    for (size_t k = 0; k < set.numShapes; ++k) {
+        __m256i hits = _mm256_and_si256(buckets, _mm256_load_si256((__m256i const*)set.masks[k]));
+        uint32_t misses = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hits, _mm256_setzero_si256()));
+        if ((set.lengths[k] >> len & 1) && !(misses & lanes)) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+inline Kernels const& kernelTable(SimdTier tier) {
+    static Kernels const tables[] = {
+        {SimdTier::Scalar, findByteScalar, findNotInSetScalar, matchShapesScalar},
+#ifdef HAVE_X86_SIMD
+        {SimdTier::SSE42, findByteSSE42, findNotInSetSSE42, matchShapesSSE42},
+        {SimdTier::AVX2, findByteAVX2, findNotInSetAVX2, matchShapesAVX2},
+        // a 32-byte string fits one AVX2 vector; 512-bit gains nothing here
+        {SimdTier::AVX512, findByteAVX512, findNotInSetAVX512, matchShapesAVX2},
+#endif
+    };
+    return tables[int(tier)];
+}
+
+inline bool tierSupported(SimdTier tier) {
+#ifdef HAVE_X86_SIMD
+    switch (tier) {
+    case SimdTier::Scalar:
+        return true;
+    case SimdTier::SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case SimdTier::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case SimdTier::AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    default:
+        return false;
+    }
+#else
+    return tier == SimdTier::Scalar;
+#endif
+}
+
+inline SimdTier detectTier() {
+    for (int tier = int(SimdTier::Count) - 1; tier > 0; --tier) {
+        if (tierSupported(SimdTier(tier))) {
+            return SimdTier(tier);
+        }
+    }
+    return SimdTier::Scalar;
+}
+
+inline std::atomic<Kernels const*>& activeKernels() {
+    static std::atomic<Kernels const*> kernels{&kernelTable(detectTier())};
+    return kernels;
+}
+
+inline Kernels const& kernels() {
+    return *activeKernels().load(std::memory_order_relaxed);
+}
+
+// Switch every kernel to `tier`; false (and no change) if this CPU can't run it
+inline bool forceTier(SimdTier tier) {
+    if (!tierSupported(tier)) {
+        return false;
+    }
+    activeKernels().store(&kernelTable(tier), std::memory_order_relaxed);
+    return true;
+}
+
+// Split text into records at each delimiter (dropping the delimiters)
+inline std::vector<std::string_view> splitRecords(std::string_view const text, char delimiter = '\n') {
+    std::vector<std::string_view> records;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = pos + kernels().findByte(text.data() + pos, text.size() - pos, delimiter);
+        records.push_back(text.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return records;
+}
+
+enum class MatchStatus { NoMatch, Match, BudgetExceeded };
+
+// Where a budgeted match stopped.  After BudgetExceeded, hand it back to resume() along
+// with the same input to carry on from `pos` in `state`.
+template <typename State>
+struct BudgetedMatch {
+    MatchStatus status;
+    size_t pos;
+    State state;
+};
+
+// Limits for one budgeted match call.  They are checked once per kCheckInterval bytes,
+// so a call may overrun a deadline by about that much work.
+struct MatchBudget {
+    static constexpr size_t kCheckInterval = 4096;
+
+    size_t bytes = SIZE_MAX;
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+
+    bool exhausted(size_t consumed) const {
+        return consumed >= bytes || (deadline && std::chrono::steady_clock::now() >= *deadline);
+    }
+
+    // Step through sv (a Symbols) from `from` a chunk at a time.  step(state, c) returns false
+    // at a dead end; accept(state) decides the outcome at the end of the input.
+    template <typename Seq, typename State, typename Step, typename Accept>
+    BudgetedMatch<State> run(Seq const sv, BudgetedMatch<State> from, Step step, Accept accept) const {
+        size_t pos = from.pos;
+        size_t consumed = 0;
+        while (pos < sv.size()) {
+            if (exhausted(consumed)) {
+                return {MatchStatus::BudgetExceeded, pos, std::move(from.state)};
+            }
+            size_t remaining = bytes - consumed;
+            size_t end = pos + std::min({kCheckInterval, remaining, sv.size() - pos});
+            consumed += end - pos;
+            for (; pos < end; ++pos) {
+                if (!step(from.state, sv[pos])) {
+                    return {MatchStatus::NoMatch, pos, std::move(from.state)};
+                }
+            }
+        }
+        auto status = accept(from.state) ? MatchStatus::Match : MatchStatus::NoMatch;
+        return {status, pos, std::move(from.state)};
+    }
+};
+
+// Input to automata over Symbol: a string_view for char, so existing callers keep passing
+// strings, and a span for wider symbols such as token ids or event types.
+template <typename Symbol>
+using Symbols = std::conditional_t<std::is_same_v<Symbol, char>, std::string_view, std::span<Symbol const>>;
+
 // Finite Automaton base class for code shared between NFA and DFA
 template <typename Edge>
 struct FABase {
@@ -37,12 +674,17 @@ struct FABase {
     }
 
 private:
-    static char printHelper(std::optional<char> const& o) {
-        return *o;
+    template <typename Symbol>
+    static auto printHelper(std::optional<Symbol> const& o) {
+        return printHelper(*o);
     }
     static char printHelper(char const& c) {
         return c;
     }
+    template <typename Symbol>
+    static unsigned long printHelper(Symbol const& c) {
+        return c;
+    }
     
 public:
     void print() const {
@@ -69,555 +711,6208 @@ public:
         }
     }
 
+    size_t numStates() const {
+        return m_states.size();
+    }
+
+    bool isMatch(StateRef state) const {
+        return m_match.count(state);
+    }
+
+    template <typename Func>
+    void forEachEdge(StateRef state, Func func) const {
+        for (auto& edge : m_states.at(state)) {
+            func(edge.first, edge.second);
+        }
+    }
+
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        usage.states = sizeof(*this) + MemoryUsage::bytes(m_states);
+        for (auto& edges : m_states) {
+            usage.edges += MemoryUsage::bytes(edges);
+        }
+        usage.accept = MemoryUsage::bytes(m_match);
+        return usage;
+    }
+
     std::vector<Edge> m_states;
     StateRef m_start = -1;
     std::unordered_set<StateRef> m_match;
 };
 
-// Deterministic Finite Automaton
-struct DFA : FABase</*Edge*/std::map<char, int>> {
-    using FABase</*Edge*/std::map<char, int>>::StateRef;
-    void addEdge(StateRef from, char cond, StateRef to) {
-        assert(m_states.at(from).insert({cond, to}).second && "duplicate edge");
+// Immutable compressed-sparse-row form of an automaton, produced by freeze().  The
+// edges of state i are (m_labels[e], m_targets[e]) for e in [m_offsets[i], m_offsets[i + 1]).
+// All arrays are carved out of one arena, so a frozen automaton costs one heap block
+// instead of one per state, and copies share the arena.
+template <typename Label>
+struct FrozenFA {
+    using StateRef = int;
+    using EdgeRef = uint64_t; // edge counts outgrow an int long before state counts do
+
+    FrozenFA() = default;
+
+    template <typename Edge>
+    explicit FrozenFA(FABase<Edge> const& fa) {
+        static_assert(alignof(Label) <= alignof(StateRef), "labels are packed after the int arrays");
+        TraceScope trace("freeze");
+        m_start = fa.m_start;
+        m_numStates = fa.m_states.size();
+        for (auto& edges : fa.m_states) {
+            m_numEdges += edges.size();
+        }
+
+        auto arena = allocate();
+        size_t e = 0;
+        for (size_t i = 0; i < m_numStates; ++i) {
+            arena.offsets[i] = e;
+            arena.matchFlags[i] = fa.m_match.count(i);
+            for (auto& edge : fa.m_states[i]) {
+                arena.labels[e] = edge.first;
+                arena.targets[e] = edge.second;
+                ++e;
+            }
+        }
+        arena.offsets[m_numStates] = e;
     }
 
-    bool testMatch(std::string_view const sv) const {
-        assert(!m_states.empty());
-        assert(m_start != -1);
-        assert(!m_match.empty());
+    // Wrap a serialized image (see writeImage()) that isImage() accepts, e.g. one returned
+    // by mapImage().  The automaton points straight into the image and keeps it alive.
+    explicit FrozenFA(std::shared_ptr<void const> image) {
+        auto header = static_cast<ImageHeader const*>(image.get());
+        assert(header->magic == imageMagic() && header->version == kImageVersion && "not a frozen automaton of this label type");
+        m_start = header->start;
+        m_numStates = header->numStates;
+        m_numEdges = header->numEdges;
+        carve(const_cast<char*>(reinterpret_cast<char const*>(header + 1)));
+        m_arena = std::move(image);
+    }
 
-        StateRef state = m_start;
+    // Read-only shared mapping of a whole file, or null if it can't be opened or mapped.
+    // Its length goes to *size.
+    static std::shared_ptr<void const> mapFile(std::string const& path, size_t* size = nullptr) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return nullptr;
+        }
+        auto mapping = mapFd(fd, size);
+        close(fd);
+        return mapping;
+    }
 
-        for (char c : sv) {
-            auto& edges = m_states.at(state);
-            auto it = edges.find(c);
-            if (it == edges.end()) {
+    // Read-only shared mapping of everything behind fd (a file or shared memory object), or
+    // null if it can't be mapped.  Its length goes to *size.
+    static std::shared_ptr<void const> mapFd(int fd, size_t* size = nullptr) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            return nullptr;
+        }
+        size_t length = st.st_size;
+        void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+        if (size) {
+            *size = length;
+        }
+        return std::shared_ptr<void const>(addr, [length](void const* p) {
+            munmap(const_cast<void*>(p), length);
+        });
+    }
+
+    // mapFd() of an image isImage() accepts, or null
+    static std::shared_ptr<void const> mapImage(int fd) {
+        size_t size = 0;
+        auto image = mapFd(fd, &size);
+        if (!image || !isImage(image.get(), size)) {
+            return nullptr;
+        }
+        return image;
+    }
+
+    // Whether the `size` bytes at image are a whole image of this label type and version,
+    // written by writeImage(): the arrays fit, the offsets are ascending and end at the edge
+    // count, and every state reference is in range.  Images come from files and from other
+    // processes, and the matchers index them without further checks.
+    static bool isImage(void const* image, size_t size) {
+        if (size < sizeof(ImageHeader)) {
+            return false;
+        }
+        auto header = static_cast<ImageHeader const*>(image);
+        if (header->magic != imageMagic() || header->version != kImageVersion) {
+            return false;
+        }
+        // bound the counts by the size first so that arenaBytes() can't overflow
+        size_t room = size - sizeof(ImageHeader);
+        if (header->numStates >= room || header->numEdges >= room
+            || arenaBytes(header->numStates, header->numEdges) > room) {
+            return false;
+        }
+        StateRef numStates = header->numStates;
+        if (header->start < (numStates ? 0 : -1) || header->start >= numStates) {
+            return false;
+        }
+
+        FrozenFA fa;
+        fa.m_numStates = header->numStates;
+        fa.m_numEdges = header->numEdges;
+        fa.carve(const_cast<char*>(reinterpret_cast<char const*>(header + 1)));
+        if (fa.m_offsets[0] != 0 || fa.m_offsets[fa.m_numStates] != fa.m_numEdges) {
+            return false;
+        }
+        for (size_t i = 0; i < fa.m_numStates; ++i) {
+            if (fa.m_offsets[i] > fa.m_offsets[i + 1]) {
                 return false;
-            } else {
-                state = it->second;
             }
         }
-
-        return m_match.count(state);
+        for (size_t e = 0; e < fa.m_numEdges; ++e) {
+            if (fa.m_targets[e] < 0 || fa.m_targets[e] >= numStates) {
+                return false;
+            }
+        }
+        return true;
     }
-};
 
-//  Nondeterministic Finite Automaton
-struct NFA : FABase</*Edge*/std::vector<std::pair<std::optional<char>, int>>> {
-    using FABase</*Edge*/std::vector<std::pair<std::optional<char>, int>>>::StateRef;
-    void addEdge(StateRef from, std::optional<char> cond, StateRef to) {
-        m_states.at(from).push_back({cond, to});
+    void writeImage(std::ostream& out) const {
+        writeImageHeader(out, m_numStates, m_numEdges, m_start);
+        out.write(reinterpret_cast<char const*>(m_offsets), arenaBytes());
     }
 
-private:
-    using sset = std::set<StateRef>;
+    // for writers that stream the arena themselves
+    static void writeImageHeader(std::ostream& out, size_t numStates, size_t numEdges, StateRef start) {
+        ImageHeader header = {imageMagic(), kImageVersion, numStates, numEdges, start};
+        out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    }
 
-    // add all edges reachable by following epsilons
-    void FollowEpsilons(sset& stateset) const {
-        std::function<void(StateRef)> recurse = [&](StateRef state) {
-            if (stateset.count(state)) {
-                return;
-            }
+    size_t numStates() const {
+        return m_numStates;
+    }
 
-            stateset.insert(state);
+    bool isMatch(StateRef state) const {
+        return m_matchFlags[state];
+    }
 
-            for (auto& edge : m_states.at(state)) {
-                if (!edge.first) {
-                    recurse(edge.second);
-                }
-            }
-        };
+    // mapped images are counted in full even though they may be shared with other processes
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        usage.states = sizeof(*this) + sizeof(EdgeRef) * (m_numStates + 1);
+        usage.edges = (sizeof(StateRef) + sizeof(Label)) * m_numEdges;
+        usage.accept = sizeof(bool) * m_numStates;
+        return usage;
+    }
 
-        auto copy = std::move(stateset);
-        stateset.clear();
-        for (auto state : copy) {
-            recurse(state);
+    template <typename Func>
+    void forEachEdge(StateRef state, Func func) const {
+        for (EdgeRef e = m_offsets[state]; e < m_offsets[state + 1]; ++e) {
+            func(m_labels[e], m_targets[e]);
         }
     }
-public:
 
-    bool testMatch(std::string_view const sv) const {
-        assert(!m_states.empty());
-        assert(m_start != -1);
-        assert(!m_match.empty());
+protected:
+    struct ImageHeader {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t numStates;
+        uint64_t numEdges;
+        int64_t start;
+    };
+
+    static uint64_t imageMagic() {
+        return 0x46524f5a454e0000ull | sizeof(Label); // "FROZEN" + label width
+    }
 
-        sset nextStates;
-        sset currentStates = {m_start};
-        FollowEpsilons(currentStates);
+    // bumped whenever the layout behind the header changes
+    static constexpr uint64_t kImageVersion = 2;
 
+    struct Arena {
+        EdgeRef* offsets;
+        StateRef* targets;
+        Label* labels;
+        bool* matchFlags;
+    };
 
-        for (char c : sv) {
-            for (auto state : currentStates) {
-                for (auto& edge : m_states.at(state)) {
-                    if (edge.first && c == *edge.first) {
-                        nextStates.insert(edge.second);
-                    }
-                }
-            }
+    size_t arenaBytes() const {
+        return arenaBytes(m_numStates, m_numEdges);
+    }
 
-            FollowEpsilons(nextStates);
-            std::swap(nextStates, currentStates);
-            nextStates.clear();
-        }
+    static size_t arenaBytes(size_t numStates, size_t numEdges) {
+        return sizeof(EdgeRef) * (numStates + 1) + sizeof(StateRef) * numEdges
+            + sizeof(Label) * numEdges + sizeof(bool) * numStates;
+    }
 
-        for (auto state : currentStates) {
-            if (m_match.count(state)) {
-                return true;
-            }
-        }
+    // lay the arrays out back to back, widest alignment first
+    Arena carve(char* base) {
+        Arena arena;
+        arena.offsets = reinterpret_cast<EdgeRef*>(base);
+        arena.targets = reinterpret_cast<StateRef*>(arena.offsets + m_numStates + 1);
+        arena.labels = reinterpret_cast<Label*>(arena.targets + m_numEdges);
+        arena.matchFlags = reinterpret_cast<bool*>(arena.labels + m_numEdges);
+
+        m_offsets = arena.offsets;
+        m_targets = arena.targets;
+        m_labels = arena.labels;
+        m_matchFlags = arena.matchFlags;
+        return arena;
+    }
 
-        return false;
+    Arena allocate() {
+        auto arena = carve(new char[arenaBytes()]);
+        m_arena = std::shared_ptr<void const>(arena.offsets, [](void const* p) {
+            delete[] static_cast<char const*>(p);
+        });
+        return arena;
     }
 
-    DFA lower() const {
-        DFA dfa;
+public:
+    StateRef m_start = -1;
+    size_t m_numStates = 0;
+    size_t m_numEdges = 0;
+
+    std::shared_ptr<void const> m_arena;
+    EdgeRef const* m_offsets = nullptr;
+    StateRef const* m_targets = nullptr;
+    Label const* m_labels = nullptr;
+    bool const* m_matchFlags = nullptr;
+};
 
-        auto hasher = [](sset const& s) {
-            std::vector<StateRef> vec(s.begin(), s.end());
-            std::sort(vec.begin(), vec.end());
-            // https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
-            int hash = 2166136261;
-            for (auto n : vec) {
-                hash ^= n;
-                hash *= 16777619;
-            }
-            return hash;
-        };
+// Frozen DFA; edges of each state are sorted by label because they come from a std::map
+struct FrozenDFA : FrozenFA</*Label*/char> {
+    using FrozenFA</*Label*/char>::FrozenFA;
 
-        std::unordered_map<sset, StateRef, decltype(hasher)> cache(m_states.size(), hasher);
-        std::function<StateRef(sset)> recurse = [&](sset states) {
-            FollowEpsilons(states);
-            if (cache.count(states)) {
-                return cache.at(states);
-            }
+    // The DFA in the image file at path, or nullopt if it can't be mapped or isn't an image
+    // of a DFA (see isImage()).
+    static std::optional<FrozenDFA> openFile(std::string const& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return std::nullopt;
+        }
+        auto dfa = openFd(fd);
+        close(fd);
+        return dfa;
+    }
 
-            auto newState = dfa.addState();
-            cache.insert({states, newState});
+    // openFile() of the file or shared memory object behind fd
+    static std::optional<FrozenDFA> openFd(int fd) {
+        auto image = mapImage(fd);
+        if (!image) {
+            return std::nullopt;
+        }
+        return FrozenDFA(std::move(image));
+    }
 
-            std::unordered_map<char, sset> newEdges;
+    bool testMatch(std::string_view const sv) const {
+        assert(m_numStates);
+        assert(m_start != -1);
 
-            for (auto state : states) {
-                if (m_match.count(state)) {
-                    dfa.addMatch(newState);
-                }
-                for (auto& edge : m_states.at(state)) {
-                    if (edge.first) {
-                        newEdges[*edge.first].insert(edge.second);
-                    }
-                }
-            }
+        StateRef state = m_start;
 
-            for (auto [c, cstates] : newEdges) {
-                dfa.addEdge(newState, c, recurse(cstates));
+        for (char c : sv) {
+            state = next(state, c);
+            if (state == -1) {
+                return false;
             }
+        }
 
-            return newState;
-        };
+        return m_matchFlags[state];
+    }
 
-        dfa.setStart(recurse({m_start}));
-        
-        return dfa;
+    BudgetedMatch<StateRef> testMatch(std::string_view const sv, MatchBudget const& budget) const {
+        return resume(sv, {MatchStatus::BudgetExceeded, 0, m_start}, budget);
     }
-};
 
+    BudgetedMatch<StateRef> resume(std::string_view const sv, BudgetedMatch<StateRef> from, MatchBudget const& budget) const {
+        return budget.run(sv, from, [&](StateRef& state, char c) {
+            state = next(state, c);
+            return state != -1;
+        }, [&](StateRef state) {
+            return m_matchFlags[state];
+        });
+    }
 
+    // successor of state on c, or -1 for a dead end
+    StateRef next(StateRef state, char c) const {
+        EdgeRef e = m_offsets[state];
+        EdgeRef const end = m_offsets[state + 1];
+        while (e < end && m_labels[e] != c) {
+            ++e;
+        }
+        return e == end ? -1 : m_targets[e];
+    }
+};
 
-// JIT the DFA! WOMM
-struct JitFunction {
-    JitFunction(DFA const& dfa) {
-        m_filename = "jitfunc" + std::to_string((std::uintptr_t)&dfa);
-        {
-            std::ofstream outs((m_filename + ".c").c_str());
+// Deterministic Finite Automaton over Symbol (see Symbols)
+template <typename Symbol>
+struct BasicDFA : FABase</*Edge*/std::map<Symbol, int>> {
+    using Base = FABase</*Edge*/std::map<Symbol, int>>;
+    using typename Base::StateRef;
+    using Base::m_states;
+    using Base::m_start;
+    using Base::m_match;
 
-            outs
-            << "int jitted(char* c, int len) { char ch;";
-            for (int i = 0; i < dfa.m_states.size(); ++i) {
-                outs
-                << std::endl
-                << "state" << i << ":"
-                << "if (!len) { return " << dfa.m_match.count(i) << "; }"
-                << "ch = *c; ++c; --len;";
+    void addEdge(StateRef from, Symbol cond, StateRef to) {
+        assert(m_states.at(from).insert({cond, to}).second && "duplicate edge");
+    }
 
-                for (auto& edge : dfa.m_states.at(i)) {
-                    outs << "if (ch == '" << edge.first << "') goto state" << edge.second << ";";
-                }
+    bool testMatch(Symbols<Symbol> const sv) const {
+        assert(!m_states.empty());
+        assert(m_start != -1);
+        assert(!m_match.empty());
 
-                outs << "return 0;";
+        StateRef state = m_start;
+
+        for (Symbol c : sv) {
+            auto& edges = m_states.at(state);
+            auto it = edges.find(c);
+            if (it == edges.end()) {
+                return false;
+            } else {
+                state = it->second;
             }
-            outs << "}" << std::endl;
         }
 
-        std::system(std::string("gcc -O3 -dynamiclib -undefined suppress -flat_namespace " + m_filename + ".c -o " + m_filename + ".dylib").c_str());
+        return m_match.count(state);
+    }
 
-        // https://developer.apple.com/library/archive/documentation/DeveloperTools/Conceptual/DynamicLibraries/100-Articles/UsingDynamicLibraries.html
-        m_lib_handle = dlopen(std::string(m_filename + ".dylib").c_str(), RTLD_LOCAL|RTLD_LAZY);
+    BudgetedMatch<StateRef> testMatch(Symbols<Symbol> const sv, MatchBudget const& budget) const {
+        return resume(sv, {MatchStatus::BudgetExceeded, 0, m_start}, budget);
+    }
 
-        if (!m_lib_handle) {
-            printf("[%s] Unable to load library: %s\n", __FILE__, dlerror());
-            exit(EXIT_FAILURE);
+    BudgetedMatch<StateRef> resume(Symbols<Symbol> const sv, BudgetedMatch<StateRef> from, MatchBudget const& budget) const {
+        return budget.run(sv, from, [&](StateRef& state, Symbol c) {
+            auto& edges = m_states.at(state);
+            auto it = edges.find(c);
+            if (it == edges.end()) {
+                return false;
+            }
+            state = it->second;
+            return true;
+        }, [&](StateRef state) {
+            return m_match.count(state) != 0;
+        });
+    }
+
+    // char DFAs only: FrozenDFA holds bytes
+    FrozenDFA freeze() const {
+        return FrozenDFA(*this);
+    }
+
+    // How often each state is entered while matching the samples
+    std::vector<uint64_t> profile(std::vector<std::string> const& samples) const {
+        std::vector<uint64_t> visits(m_states.size());
+        for (auto& sample : samples) {
+            StateRef state = m_start;
+            ++visits.at(state);
+            for (char c : sample) {
+                auto& edges = m_states.at(state);
+                auto it = edges.find(c);
+                if (it == edges.end()) {
+                    break;
+                }
+                state = it->second;
+                ++visits.at(state);
+            }
         }
+        return visits;
+    }
+};
 
-        m_jitted = (decltype(m_jitted))dlsym(m_lib_handle, "jitted");
+using DFA = BasicDFA<char>;
+
+// Equivalence classes of a DFA's symbols: symbols that send every state to the same place
+// share a class, and symbols on no edge at all are class 0.  Byte and 16-bit symbols look
+// their class up in a flat table; wider ones binary search the labelled symbols.
+template <typename Symbol>
+struct SymbolClasses {
+    explicit SymbolClasses(BasicDFA<Symbol> const& dfa) {
+        std::map<Symbol, std::vector<int>> columns;
+        for (int i = 0; i < int(dfa.numStates()); ++i) {
+            dfa.forEachEdge(i, [&](Symbol c, int to) {
+                auto& column = columns[c];
+                column.resize(dfa.numStates(), -1);
+                column[i] = to;
+            });
+        }
 
-        if (!m_jitted) {
-            printf("[%s] Unable to get symbol: %s\n", __FILE__, dlerror());
-            exit(EXIT_FAILURE);
+        if constexpr (kFlat) {
+            m_flat.resize(size_t(1) << 8 * sizeof(Symbol));
+        }
+        std::map<std::vector<int>, uint32_t> classOf;
+        for (auto& [c, column] : columns) {
+            auto cls = classOf.insert({column, classOf.size() + 1}).first->second;
+            if constexpr (kFlat) {
+                m_flat[Unsigned(c)] = cls;
+            } else {
+                m_sorted.push_back({c, cls});
+            }
         }
+        m_size = classOf.size() + 1;
     }
 
-    ~JitFunction() {
-        if (dlclose(m_lib_handle) != 0) {
-            printf("[%s] Problem closing library: %s", __FILE__, dlerror());
+    uint32_t operator()(Symbol c) const {
+        if constexpr (kFlat) {
+            return m_flat[Unsigned(c)];
+        } else {
+            auto it = std::lower_bound(m_sorted.begin(), m_sorted.end(), c, [](auto const& entry, Symbol c) {
+                return entry.first < c;
+            });
+            return it != m_sorted.end() && it->first == c ? it->second : 0;
         }
-        std::system(std::string("rm -f " + m_filename + ".c " + m_filename + ".dylib").c_str());
     }
 
-    bool operator()(std::string_view const sv) {
-        assert(m_jitted);
-        return m_jitted((char*)sv.data(), (int)sv.size());
+    size_t size() const {
+        return m_size;
     }
 
-    int (*m_jitted)(char* c, int len);
-    std::string m_filename;
-    void* m_lib_handle;
-};
+    size_t bytes() const {
+        return MemoryUsage::bytes(m_flat) + MemoryUsage::bytes(m_sorted);
+    }
 
+private:
+    using Unsigned = std::make_unsigned_t<Symbol>;
+    static constexpr bool kFlat = sizeof(Symbol) <= 2;
 
-struct Benchmark {
-    std::vector<std::string> tests;
+    std::vector<uint32_t> m_flat;                      // indexed by symbol, if kFlat
+    std::vector<std::pair<Symbol, uint32_t>> m_sorted; // by symbol, otherwise
+    size_t m_size = 0;
+};
 
-    Benchmark(std::vector<std::string> cases) {
-        srand(0);
-        for (int i = 0; i < 1000000; ++i) {
-            tests.push_back(cases.at(rand() % cases.size()));
+// Table-driven DFA: a row of next states per state, one entry per symbol class, so a step
+// costs a class lookup and an index however wide Symbol is.
+template <typename Symbol>
+struct DenseDFA {
+    explicit DenseDFA(BasicDFA<Symbol> const& dfa)
+        : m_classes(dfa), m_table(dfa.numStates() * m_classes.size(), -1), m_match(dfa.numStates()), m_start(dfa.m_start) {
+        for (int i = 0; i < int(dfa.numStates()); ++i) {
+            m_match[i] = dfa.isMatch(i);
+            dfa.forEachEdge(i, [&](Symbol c, int to) {
+                m_table[i * m_classes.size() + m_classes(c)] = to;
+            });
         }
     }
 
-    template <typename Func>
-    int operator()(Func func) const {
-        struct TimedScope {
-            TimedScope() {
-                start = std::chrono::steady_clock::now();
-            }
-
-            ~TimedScope() {
-                auto stop = std::chrono::steady_clock::now();
-                std::cout << "elapsed time: " << std::chrono::duration<double, std::milli>(stop - start).count() << "ms" << std::endl;
-            }
-            std::chrono::time_point<std::chrono::steady_clock> start;
-        };
-
-        int count = 0;
-        {
-            TimedScope timer;
-            for (auto& test : tests) {
-                count += func(test);
+    bool testMatch(Symbols<Symbol> const sv) const {
+        int state = m_start;
+        for (Symbol c : sv) {
+            state = m_table[state * m_classes.size() + m_classes(c)];
+            if (state == -1) {
+                return false;
             }
         }
-        return count;
+        return m_match[state];
     }
-};
-
-// Helpers to make regex/NFA from parser
 
-struct Char {
-    Char(char c) : c(c) {};
-    char c;
+    size_t numClasses() const {
+        return m_classes.size();
+    }
 
-    std::string toStr() const {
-        return std::string({c});
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        usage.states = sizeof(*this);
+        usage.tables = MemoryUsage::bytes(m_table) + m_classes.bytes();
+        usage.accept = MemoryUsage::bytes(m_match);
+        return usage;
     }
 
-    NFA toNFA() const {
-        NFA nfa;
+private:
+    SymbolClasses<Symbol> m_classes;
+    std::vector<int> m_table;
+    std::vector<char> m_match;
+    int m_start;
+};
 
-        auto start = nfa.addState();
-        nfa.setStart(start);
+// States of fa (a DFA or FrozenDFA) from which some accepting state can be reached
+template <typename FA>
+std::vector<bool> liveStates(FA const& fa) {
+    using StateRef = typename FA::StateRef;
+    auto const n = StateRef(fa.numStates());
+
+    std::vector<std::vector<StateRef>> reverse(n);
+    for (StateRef state = 0; state < n; ++state) {
+        fa.forEachEdge(state, [&](char, StateRef to) {
+            reverse[to].push_back(state);
+        });
+    }
+    std::vector<bool> live(n);
+    std::vector<StateRef> work;
+    for (StateRef state = 0; state < n; ++state) {
+        if (fa.isMatch(state)) {
+            live[state] = true;
+            work.push_back(state);
+        }
+    }
+    while (!work.empty()) {
+        auto state = work.back();
+        work.pop_back();
+        for (auto from : reverse[state]) {
+            if (!live[from]) {
+                live[from] = true;
+                work.push_back(from);
+            }
+        }
+    }
+    return live;
+}
 
-        auto match = nfa.addState();
-        nfa.addMatch(match);
+// Necessary conditions for a full match, cheap enough to check before running the automaton:
+// every byte must label an edge on some accepting path (the live alphabet) and every pair of
+// adjacent bytes must label two consecutive such edges (the bigrams).  Inputs like
+// "blah blah blah" against a(bb)+a fail on their first vector of bytes.
+struct FeasibilityFilter {
+    // fa is a DFA or FrozenDFA, typically straight out of lower()
+    template <typename FA>
+    explicit FeasibilityFilter(FA const& fa) : m_bigrams(65536 / 64) {
+        TraceScope trace("feasibility");
+        using StateRef = typename FA::StateRef;
+        auto const n = StateRef(fa.numStates());
+
+        std::vector<bool> reachable(n);
+        std::vector<StateRef> work{fa.m_start};
+        reachable[fa.m_start] = true;
+        while (!work.empty()) {
+            auto state = work.back();
+            work.pop_back();
+            fa.forEachEdge(state, [&](char, StateRef to) {
+                if (!reachable[to]) {
+                    reachable[to] = true;
+                    work.push_back(to);
+                }
+            });
+        }
 
-        nfa.addEdge(start, c, match);
+        auto live = liveStates(fa);
+        for (StateRef state = 0; state < n; ++state) {
+            if (!reachable[state]) {
+                continue;
+            }
+            fa.forEachEdge(state, [&](char first, StateRef mid) {
+                if (!live[mid]) {
+                    return;
+                }
+                m_alphabet.insert(first);
+                fa.forEachEdge(mid, [&](char second, StateRef to) {
+                    if (live[to]) {
+                        unsigned pair = uint8_t(first) << 8 | uint8_t(second);
+                        m_bigrams[pair >> 6] |= uint64_t(1) << (pair & 63);
+                    }
+                });
+            });
+        }
+    }
 
-        return nfa;
+    // false only if sv can't possibly fully match
+    bool operator()(std::string_view const sv) const {
+        if (kernels().findNotInSet(sv.data(), sv.size(), m_alphabet) != sv.size()) {
+            return false;
+        }
+        for (size_t i = 1; i < sv.size(); ++i) {
+            unsigned pair = uint8_t(sv[i - 1]) << 8 | uint8_t(sv[i]);
+            if (!(m_bigrams[pair >> 6] >> (pair & 63) & 1)) {
+                return false;
+            }
+        }
+        return true;
     }
-};
 
-// insert src into dst at dstref.  Creates a state that indicates a match of src in dst, and returns a ref.
-NFA::StateRef merge(NFA& dst, NFA::StateRef dstref, NFA&& src) {
-    // this map could just be addition but this is fine
-    std::unordered_map</*src*/ NFA::StateRef, /*dst*/NFA::StateRef> newEdges;
-    for (NFA::StateRef i = 0; i < src.m_states.size(); ++i) {
-        newEdges[i] = dst.addState();
+    ByteSet const& alphabet() const {
+        return m_alphabet;
     }
 
-    for (NFA::StateRef i = 0; i < src.m_states.size(); ++i) {
-        for (auto& edge : src.m_states.at(i)) {
-            dst.addEdge(newEdges.at(i), edge.first, newEdges.at(edge.second));
+    size_t numBigrams() const {
+        size_t n = 0;
+        for (auto word : m_bigrams) {
+            n += __builtin_popcountll(word);
         }
+        return n;
     }
 
-    // map dstRef to the start node
-    dst.addEdge(dstref, std::nullopt, newEdges.at(src.m_start));
-
-    // map the matching nodes to one node
-    auto matchsrc = dst.addState();
-
-    for (auto srcstate : src.m_match) {
-        dst.addEdge(newEdges.at(srcstate), std::nullopt, matchsrc);
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        usage.tables = sizeof(*this) + MemoryUsage::bytes(m_bigrams);
+        return usage;
     }
 
-    return matchsrc;
-}
+private:
+    ByteSet m_alphabet;
+    std::vector<uint64_t> m_bigrams; // 64K bits, indexed by first << 8 | second
+};
 
-template <typename A, typename B>
-struct And {
-    And(A a, B b) : a(a), b(b) {}
-    A a;
-    B b;
+// Whole-string check for patterns whose strings are all short, such as status codes, IPv4
+// octets or fixed-width hex ids.  compile() unrolls an acyclic DFA into its paths; a path
+// accepts exactly the product of the byte sets on its edges, one set per position.  Paths
+// are merged while that stays exact (one a prefix of the other, or equal lengths and a
+// single differing position) into at most ShapeSet::kMaxShapes shapes, and the position
+// sets are cut into nibble rectangles that become the buckets.  match() is then a handful
+// of vector compares with no per-byte loop.
+struct ShortVerifier {
+    static constexpr size_t kMaxPaths = 256;
+
+    // nullopt if fa is cyclic, accepts strings over ShapeSet::kMaxLength, or needs more
+    // shapes or buckets than a ShapeSet holds
+    template <typename FA>
+    static std::optional<ShortVerifier> compile(FA const& fa) {
+        TraceScope trace("shortVerifier");
+        using StateRef = typename FA::StateRef;
+        auto const n = StateRef(fa.numStates());
+
+        auto live = liveStates(fa);
+        if (!live[fa.m_start]) {
+            return std::nullopt;
+        }
 
-    std::string toStr() const {
-        return a.toStr() + b.toStr();
-    }
+        // each state's live successors, with the bytes leading to each
+        std::vector<std::map<StateRef, Bytes>> next(n);
+        for (StateRef state = 0; state < n; ++state) {
+            fa.forEachEdge(state, [&](char c, StateRef to) {
+                if (live[to]) {
+                    insert(next[state][to], c);
+                }
+            });
+        }
 
-    NFA toNFA() const {
-        NFA nfa;
+        // a cycle shows up as a path longer than any allowed
+        std::vector<Shape> shapes;
+        std::vector<Bytes> path;
+        bool ok = true;
+        std::function<void(StateRef)> unroll = [&](StateRef state) {
+            if (fa.isMatch(state)) {
+                shapes.push_back({path, uint64_t(1) << path.size()});
+            }
+            for (auto& [to, bytes] : next[state]) {
+                if (path.size() == ShapeSet::kMaxLength || shapes.size() > kMaxPaths) {
+                    ok = false;
+                }
+                if (!ok) {
+                    return;
+                }
+                path.push_back(bytes);
+                unroll(to);
+                path.pop_back();
+            }
+        };
+        unroll(fa.m_start);
+        if (!ok) {
+            return std::nullopt;
+        }
 
-        auto start = nfa.addState();
-        nfa.setStart(start);
+        while (mergeOne(shapes)) {
+        }
+        if (shapes.size() > ShapeSet::kMaxShapes) {
+            return std::nullopt;
+        }
 
-        auto mid = merge(nfa, start, a.toNFA());
-        auto match = merge(nfa, mid, b.toNFA());
+        // buckets: the distinct rectangles of every position set
+        std::vector<std::pair<uint16_t, uint16_t>> buckets; // low nibbles, high nibbles
+        for (auto& shape : shapes) {
+            for (auto& bytes : shape.positions) {
+                for (auto rect : rectangles(bytes)) {
+                    if (std::find(buckets.begin(), buckets.end(), rect) == buckets.end()) {
+                        buckets.push_back(rect);
+                    }
+                }
+            }
+        }
+        if (buckets.size() > 8) {
+            return std::nullopt;
+        }
 
-        nfa.addMatch(match);
+        ShortVerifier verifier;
+        auto& set = verifier.m_set;
+        for (size_t b = 0; b < buckets.size(); ++b) {
+            for (int nibble = 0; nibble < 16; ++nibble) {
+                set.lowBuckets[nibble] |= (buckets[b].first >> nibble & 1) << b;
+                set.highBuckets[nibble] |= (buckets[b].second >> nibble & 1) << b;
+            }
+        }
+        set.numShapes = shapes.size();
+        for (size_t k = 0; k < shapes.size(); ++k) {
+            set.lengths[k] = shapes[k].lengths;
+            set.maxLength = std::max(set.maxLength, shapes[k].positions.size());
+            for (size_t i = 0; i < shapes[k].positions.size(); ++i) {
+                for (size_t b = 0; b < buckets.size(); ++b) {
+                    if (covers(shapes[k].positions[i], buckets[b])) {
+                        set.masks[k][i] |= 1 << b;
+                    }
+                }
+            }
+        }
+        return verifier;
+    }
 
-        return nfa;
+    bool match(std::string_view const sv) const {
+        return kernels().matchShapes(m_set, sv.data(), sv.size());
     }
-};
 
-template <typename A, typename B>
-struct Or {
-    Or(A a, B b) : a(a), b(b) {}
-    A a;
-    B b;
+    size_t numShapes() const {
+        return m_set.numShapes;
+    }
 
-    std::string toStr() const {
-        return "(" + a.toStr() + ")|(" + b.toStr() + ")";
+    size_t maxLength() const {
+        return m_set.maxLength;
     }
 
-    NFA toNFA() const {
-        NFA nfa;
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        usage.tables = sizeof(*this);
+        return usage;
+    }
 
-        auto start = nfa.addState();
-        nfa.setStart(start);
+private:
+    using Bytes = std::array<uint64_t, 4>; // a set of byte values
 
-        auto matcha = merge(nfa, start, a.toNFA());
-        auto matchb = merge(nfa, start, b.toNFA());
+    struct Shape {
+        std::vector<Bytes> positions;
+        uint64_t lengths; // bit n: accepts the strings of length n matching the first n positions
+    };
 
-        nfa.addMatch(matcha);
-        nfa.addMatch(matchb);
+    static void insert(Bytes& bytes, char c) {
+        bytes[uint8_t(c) >> 6] |= uint64_t(1) << (c & 63);
+    }
 
-        return nfa;
+    static bool has(Bytes const& bytes, int c) {
+        return bytes[c >> 6] >> (c & 63) & 1;
     }
-};
 
-template <typename A>
+    // Merge one pair of shapes if that keeps the language the same
+    static bool mergeOne(std::vector<Shape>& shapes) {
+        for (size_t a = 0; a < shapes.size(); ++a) {
+            for (size_t b = 0; b < shapes.size(); ++b) {
+                auto& x = shapes[a];
+                auto& y = shapes[b];
+                if (a == b || x.positions.size() > y.positions.size()) {
+                    continue;
+                }
+                if (std::equal(x.positions.begin(), x.positions.end(), y.positions.begin())) {
+                    y.lengths |= x.lengths;
+                    shapes.erase(shapes.begin() + a);
+                    return true;
+                }
+                if (x.positions.size() != y.positions.size() || x.lengths != y.lengths) {
+                    continue;
+                }
+                size_t differ = 0, at = 0;
+                for (size_t i = 0; i < x.positions.size(); ++i) {
+                    if (x.positions[i] != y.positions[i]) {
+                        ++differ;
+                        at = i;
+                    }
+                }
+                if (differ == 1) {
+                    for (int w = 0; w < 4; ++w) {
+                        x.positions[at][w] |= y.positions[at][w];
+                    }
+                    shapes.erase(shapes.begin() + b);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // bytes as (low nibbles, high nibbles) rectangles: high nibbles sharing a low-nibble set
+    static std::vector<std::pair<uint16_t, uint16_t>> rectangles(Bytes const& bytes) {
+        std::map<uint16_t, uint16_t> highsByLows;
+        for (int high = 0; high < 16; ++high) {
+            uint16_t lows = 0;
+            for (int low = 0; low < 16; ++low) {
+                lows |= has(bytes, high << 4 | low) << low;
+            }
+            if (lows) {
+                highsByLows[lows] |= 1 << high;
+            }
+        }
+        return {highsByLows.begin(), highsByLows.end()};
+    }
+
+    static bool covers(Bytes const& bytes, std::pair<uint16_t, uint16_t> rect) {
+        for (int high = 0; high < 16; ++high) {
+            for (int low = 0; low < 16; ++low) {
+                if ((rect.first >> low & 1) && (rect.second >> high & 1) && !has(bytes, high << 4 | low)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    ShapeSet m_set;
+};
+
+// FIFO of byte strings that keeps at most `budget` bytes in memory and spills the rest to
+// a file.  Once anything has spilled, new entries go to the file too so order is kept.
+struct SpillQueue {
+    SpillQueue(std::string path, size_t budget) : m_path(std::move(path)), m_budget(budget) {
+        m_file.open(m_path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+        assert(m_file && "unable to open spill file");
+    }
+
+    ~SpillQueue() {
+        m_file.close();
+        std::remove(m_path.c_str());
+    }
+
+    bool empty() const {
+        return m_memory.empty() && !m_onDisk;
+    }
+
+    void push(std::string str) {
+        if (m_onDisk || m_bytes + str.size() > m_budget) {
+            uint32_t size = str.size();
+            m_file.seekp(m_writeOffset);
+            m_file.write(reinterpret_cast<char const*>(&size), sizeof(size));
+            m_file.write(str.data(), size);
+            m_writeOffset += sizeof(size) + size;
+            ++m_onDisk;
+            ++m_spilled;
+        } else {
+            m_bytes += str.size();
+            m_memory.push_back(std::move(str));
+        }
+    }
+
+    std::string pop() {
+        assert(!empty());
+        if (m_memory.empty()) {
+            refill();
+        }
+        auto str = std::move(m_memory.front());
+        m_memory.pop_front();
+        m_bytes -= str.size();
+        return str;
+    }
+
+    size_t spilled() const {
+        return m_spilled;
+    }
+
+private:
+    // loads at least one entry, even past the budget (or with a budget of 0)
+    void refill() {
+        m_file.flush();
+        m_file.seekg(m_readOffset);
+        while (m_onDisk && (m_memory.empty() || m_bytes < m_budget)) {
+            uint32_t size;
+            m_file.read(reinterpret_cast<char*>(&size), sizeof(size));
+            std::string str(size, '\0');
+            m_file.read(str.data(), size);
+            m_readOffset += sizeof(size) + size;
+            --m_onDisk;
+            m_bytes += size;
+            m_memory.push_back(std::move(str));
+        }
+        if (!m_onDisk) {
+            m_readOffset = m_writeOffset = 0;
+        }
+    }
+
+    std::string m_path;
+    size_t m_budget;
+    std::fstream m_file;
+    std::deque<std::string> m_memory;
+    size_t m_bytes = 0;
+    size_t m_onDisk = 0;
+    size_t m_spilled = 0;
+    std::streamoff m_readOffset = 0;
+    std::streamoff m_writeOffset = 0;
+};
+
+struct OfflineLowerStats {
+    size_t states = 0;
+    size_t edges = 0;
+    size_t spilled = 0;
+    size_t cacheBytes = 0;
+};
+
+// NFA simulation and subset construction.  Shared by NFA and FrozenNFA, which provide
+// m_start, numStates(), isMatch() and forEachEdge().
+template <typename Derived, typename Symbol = char>
+struct NFAOps {
+    using StateRef = int;
+
+protected:
+    using sset = std::set<StateRef>;
+
+    Derived const& self() const {
+        return static_cast<Derived const&>(*this);
+    }
+
+    // add all edges reachable by following epsilons
+    void FollowEpsilons(sset& stateset) const {
+        std::function<void(StateRef)> recurse = [&](StateRef state) {
+            if (stateset.count(state)) {
+                return;
+            }
+
+            stateset.insert(state);
+
+            self().forEachEdge(state, [&](std::optional<Symbol> const& cond, StateRef to) {
+                if (!cond) {
+                    recurse(to);
+                }
+            });
+        };
+
+        auto copy = std::move(stateset);
+        stateset.clear();
+        for (auto state : copy) {
+            recurse(state);
+        }
+    }
+public:
+
+    bool testMatch(Symbols<Symbol> const sv) const {
+        assert(self().numStates());
+        assert(self().m_start != -1);
+
+        sset nextStates;
+        sset currentStates = startStates();
+
+
+        for (Symbol c : sv) {
+            step(currentStates, nextStates, c);
+        }
+
+        return anyMatch(currentStates);
+    }
+
+    BudgetedMatch<sset> testMatch(Symbols<Symbol> const sv, MatchBudget const& budget) const {
+        return resume(sv, {MatchStatus::BudgetExceeded, 0, startStates()}, budget);
+    }
+
+    BudgetedMatch<sset> resume(Symbols<Symbol> const sv, BudgetedMatch<sset> from, MatchBudget const& budget) const {
+        sset nextStates;
+        return budget.run(sv, std::move(from), [&](sset& currentStates, Symbol c) {
+            step(currentStates, nextStates, c);
+            return !currentStates.empty();
+        }, [&](sset const& currentStates) {
+            return anyMatch(currentStates);
+        });
+    }
+
+protected:
+    sset startStates() const {
+        sset states = {self().m_start};
+        FollowEpsilons(states);
+        return states;
+    }
+
+    // advance currentStates over c; nextStates is scratch
+    void step(sset& currentStates, sset& nextStates, Symbol c) const {
+        for (auto state : currentStates) {
+            self().forEachEdge(state, [&](std::optional<Symbol> const& cond, StateRef to) {
+                if (cond && c == *cond) {
+                    nextStates.insert(to);
+                }
+            });
+        }
+
+        FollowEpsilons(nextStates);
+        std::swap(nextStates, currentStates);
+        nextStates.clear();
+    }
+
+    bool anyMatch(sset const& states) const {
+        for (auto state : states) {
+            if (self().isMatch(state)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+public:
+
+    BasicDFA<Symbol> lower() const {
+        TraceScope trace("lower");
+        BasicDFA<Symbol> dfa;
+
+        auto hasher = [](sset const& s) {
+            std::vector<StateRef> vec(s.begin(), s.end());
+            std::sort(vec.begin(), vec.end());
+            // https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
+            int hash = 2166136261;
+            for (auto n : vec) {
+                hash ^= n;
+                hash *= 16777619;
+            }
+            return hash;
+        };
+
+        std::unordered_map<sset, StateRef, decltype(hasher)> cache(self().numStates(), hasher);
+        std::function<StateRef(sset)> recurse = [&](sset states) {
+            FollowEpsilons(states);
+            if (cache.count(states)) {
+                return cache.at(states);
+            }
+
+            auto newState = dfa.addState();
+            cache.insert({states, newState});
+
+            std::unordered_map<Symbol, sset> newEdges;
+
+            bool match = false;
+            for (auto state : states) {
+                match = match || self().isMatch(state);
+                self().forEachEdge(state, [&](std::optional<Symbol> const& cond, StateRef to) {
+                    if (cond) {
+                        newEdges[*cond].insert(to);
+                    }
+                });
+            }
+            if (match) {
+                dfa.addMatch(newState);
+            }
+
+            for (auto [c, cstates] : newEdges) {
+                dfa.addEdge(newState, c, recurse(cstates));
+            }
+
+            return newState;
+        };
+
+        dfa.setStart(recurse({self().m_start}));
+        
+        return dfa;
+    }
+
+    // Subset construction for automata too big for lower().  State sets are kept as
+    // delta-encoded varints, the frontier spills to disk past `budget` bytes, and the DFA
+    // is streamed into a frozen image at `path` which is then mapped back in.  States are
+    // numbered and expanded in the same FIFO order, so edges come out already in CSR order.
+    // Only the frontier spills: the map from encoded state sets to state numbers stays in
+    // memory (stats->cacheBytes), so the DFA's state sets must fit in RAM even where its
+    // edges and frontier don't.  Returns nullopt if the image can't be mapped back, e.g.
+    // because writing it failed.
+    std::optional<FrozenDFA> lowerOffline(std::string const& path, size_t budget, OfflineLowerStats* stats = nullptr) const {
+        static_assert(std::is_same_v<Symbol, char>, "lowerOffline() writes a FrozenDFA, whose labels are bytes");
+        TraceScope trace("lowerOffline");
+        std::ofstream offsets(path + ".offsets", std::ios::binary);
+        std::ofstream targets(path + ".targets", std::ios::binary);
+        std::ofstream labels(path + ".labels", std::ios::binary);
+        std::ofstream flags(path + ".flags", std::ios::binary);
+
+        std::unordered_map<std::string, StateRef> cache;
+        size_t cacheBytes = 0;
+        SpillQueue frontier(path + ".frontier", budget);
+
+        auto intern = [&](sset states) {
+            FollowEpsilons(states);
+            auto key = encodeSet(states);
+            auto [it, inserted] = cache.insert({key, cache.size()});
+            if (inserted) {
+                cacheBytes += key.size() + sizeof(*it);
+                frontier.push(std::move(key));
+            }
+            return it->second;
+        };
+
+        FrozenDFA::EdgeRef numEdges = 0;
+        size_t expanded = 0;
+        intern({self().m_start});
+        while (!frontier.empty()) {
+            auto states = decodeSet(frontier.pop());
+
+            bool match = false;
+            std::map<Symbol, sset> newEdges;
+            for (auto state : states) {
+                match = match || self().isMatch(state);
+                self().forEachEdge(state, [&](std::optional<Symbol> const& cond, StateRef to) {
+                    if (cond) {
+                        newEdges[*cond].insert(to);
+                    }
+                });
+            }
+
+            offsets.write(reinterpret_cast<char const*>(&numEdges), sizeof(numEdges));
+            flags.put(match);
+            for (auto& [c, cstates] : newEdges) {
+                StateRef to = intern(cstates);
+                targets.write(reinterpret_cast<char const*>(&to), sizeof(to));
+                labels.put(c);
+                ++numEdges;
+            }
+            ++expanded;
+        }
+        offsets.write(reinterpret_cast<char const*>(&numEdges), sizeof(numEdges));
+        assert(expanded == cache.size());
+
+        if (stats) {
+            stats->states = expanded;
+            stats->edges = numEdges;
+            stats->spilled = frontier.spilled();
+            stats->cacheBytes = cacheBytes;
+        }
+
+        // stitch the pieces into one image: same layout as FrozenFA::writeImage()
+        offsets.close();
+        targets.close();
+        labels.close();
+        flags.close();
+        {
+            std::ofstream image(path, std::ios::binary);
+            FrozenDFA::writeImageHeader(image, expanded, numEdges, /*start*/0);
+            for (auto suffix : {".offsets", ".targets", ".labels", ".flags"}) {
+                std::ifstream part(path + suffix, std::ios::binary);
+                image << part.rdbuf();
+                part.close();
+                std::remove((path + suffix).c_str());
+            }
+        }
+
+        return FrozenDFA::openFile(path);
+    }
+
+protected:
+    static std::string encodeSet(sset const& states) {
+        std::string out;
+        StateRef prev = 0;
+        for (auto state : states) {
+            unsigned delta = state - prev;
+            prev = state;
+            while (delta >= 0x80) {
+                out.push_back(char(delta | 0x80));
+                delta >>= 7;
+            }
+            out.push_back(char(delta));
+        }
+        return out;
+    }
+
+    static sset decodeSet(std::string const& in) {
+        sset states;
+        StateRef prev = 0;
+        for (size_t i = 0; i < in.size();) {
+            unsigned delta = 0;
+            for (int shift = 0;; shift += 7) {
+                unsigned char byte = in[i++];
+                delta |= unsigned(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            prev += delta;
+            states.insert(states.end(), prev);
+        }
+        return states;
+    }
+};
+
+struct FrozenNFA : FrozenFA</*Label*/std::optional<char>>, NFAOps<FrozenNFA> {
+    using FrozenFA</*Label*/std::optional<char>>::FrozenFA;
+    using FrozenFA</*Label*/std::optional<char>>::StateRef;
+
+    // scratch is the two state sets testMatch() swaps between, at their largest
+    MemoryUsage memoryUsage() const {
+        auto usage = FrozenFA::memoryUsage();
+        usage.scratch = 2 * m_numStates * (MemoryUsage::kTreeNodeOverhead + sizeof(StateRef));
+        return usage;
+    }
+};
+
+//  Nondeterministic Finite Automaton over Symbol (see Symbols)
+template <typename Symbol>
+struct BasicNFA : FABase</*Edge*/std::vector<std::pair<std::optional<Symbol>, int>>>, NFAOps<BasicNFA<Symbol>, Symbol> {
+    using Base = FABase</*Edge*/std::vector<std::pair<std::optional<Symbol>, int>>>;
+    using Ops = NFAOps<BasicNFA<Symbol>, Symbol>;
+    using typename Base::StateRef;
+    using Base::m_states;
+    using Base::m_start;
+    using Base::m_match;
+    using Base::addState;
+    using Base::setStart;
+    using Base::addMatch;
+    using Base::numStates;
+    using Ops::testMatch;
+    using Ops::lower;
+    using typename Ops::sset;
+    using Ops::FollowEpsilons;
+
+    void addEdge(StateRef from, std::optional<Symbol> cond, StateRef to) {
+        m_states.at(from).push_back({cond, to});
+    }
+
+    // Capture slot recorded when a match passes through a state (see Capture and BitState).
+    // Other engines ignore tags, and reduce() and freeze() drop them.
+    void addTag(StateRef state, int slot) {
+        assert(m_tags.insert({state, slot}).second && "state already tagged");
+    }
+
+    std::unordered_map<StateRef, int> m_tags;
+
+    // Pack into CSR form.  The frozen copy simulates and lowers like this one.  char only.
+    FrozenNFA freeze() const {
+        return FrozenNFA(*this);
+    }
+
+    // scratch is the two state sets testMatch() swaps between, at their largest
+    MemoryUsage memoryUsage() const {
+        auto usage = Base::memoryUsage();
+        usage.scratch = 2 * m_states.size() * (MemoryUsage::kTreeNodeOverhead + sizeof(StateRef));
+        return usage;
+    }
+
+    // Language-preserving state reduction, meant to run before lower().  Removes epsilons,
+    // drops states that are unreachable or can't reach a match, then alternately merges
+    // forward-bisimilar states (same future) and backward-bisimilar states (same past)
+    // until neither pass shrinks the automaton.
+    BasicNFA reduce() const {
+        TraceScope trace("reduce");
+        BasicNFA nfa = removeEpsilons().trim();
+        for (;;) {
+            auto before = nfa.numStates();
+            nfa = nfa.quotient(nfa.bisimulation(/*forward*/true));
+            nfa = nfa.quotient(nfa.bisimulation(/*forward*/false));
+            if (nfa.numStates() == before) {
+                return nfa;
+            }
+        }
+    }
+
+private:
+    BasicNFA removeEpsilons() const {
+        BasicNFA nfa;
+        for (size_t i = 0; i < m_states.size(); ++i) {
+            nfa.addState();
+        }
+        nfa.setStart(m_start);
+
+        for (StateRef i = 0; i < m_states.size(); ++i) {
+            sset closure = {i};
+            FollowEpsilons(closure);
+
+            std::set<std::pair<Symbol, StateRef>> edges;
+            bool match = false;
+            for (auto state : closure) {
+                match = match || m_match.count(state);
+                for (auto& edge : m_states.at(state)) {
+                    if (edge.first) {
+                        edges.insert({*edge.first, edge.second});
+                    }
+                }
+            }
+
+            if (match) {
+                nfa.addMatch(i);
+            }
+            for (auto [c, to] : edges) {
+                nfa.addEdge(i, c, to);
+            }
+        }
+        return nfa;
+    }
+
+    // keep only states on some path from the start to a match
+    BasicNFA trim() const {
+        std::vector<std::vector<StateRef>> preds(m_states.size());
+        for (StateRef i = 0; i < m_states.size(); ++i) {
+            for (auto& edge : m_states.at(i)) {
+                preds.at(edge.second).push_back(i);
+            }
+        }
+
+        auto mark = [&](std::vector<StateRef> work, auto const& next) {
+            std::vector<bool> seen(m_states.size());
+            for (auto state : work) {
+                seen.at(state) = true;
+            }
+            while (!work.empty()) {
+                auto state = work.back();
+                work.pop_back();
+                next(state, [&](StateRef to) {
+                    if (!seen.at(to)) {
+                        seen.at(to) = true;
+                        work.push_back(to);
+                    }
+                });
+            }
+            return seen;
+        };
+
+        auto reachable = mark({m_start}, [&](StateRef state, auto const& visit) {
+            for (auto& edge : m_states.at(state)) {
+                visit(edge.second);
+            }
+        });
+        auto live = mark(std::vector<StateRef>(m_match.begin(), m_match.end()), [&](StateRef state, auto const& visit) {
+            for (auto pred : preds.at(state)) {
+                visit(pred);
+            }
+        });
+
+        std::vector<StateRef> block(m_states.size(), -1);
+        StateRef next = 0;
+        for (StateRef i = 0; i < m_states.size(); ++i) {
+            if (i == m_start || (reachable.at(i) && live.at(i))) {
+                block.at(i) = next++;
+            }
+        }
+        return quotient(block);
+    }
+
+    // Coarsest partition where states in a block agree on acceptance (forward) or on being
+    // the start (backward), and on which blocks they reach (or are reached from) per label.
+    std::vector<StateRef> bisimulation(bool forward) const {
+        std::vector<std::vector<std::pair<Symbol, StateRef>>> adjacent(m_states.size());
+        for (StateRef i = 0; i < m_states.size(); ++i) {
+            for (auto& edge : m_states.at(i)) {
+                if (forward) {
+                    adjacent.at(i).push_back({*edge.first, edge.second});
+                } else {
+                    adjacent.at(edge.second).push_back({*edge.first, i});
+                }
+            }
+        }
+
+        std::vector<StateRef> block(m_states.size());
+        for (StateRef i = 0; i < m_states.size(); ++i) {
+            block.at(i) = forward ? m_match.count(i) : i == m_start;
+        }
+
+        size_t numBlocks = 0;
+        for (;;) {
+            std::map<std::vector<StateRef>, StateRef> signatures;
+            std::vector<StateRef> refined(m_states.size());
+            for (StateRef i = 0; i < m_states.size(); ++i) {
+                std::set<std::pair<Symbol, StateRef>> moves;
+                for (auto [c, other] : adjacent.at(i)) {
+                    moves.insert({c, block.at(other)});
+                }
+                std::vector<StateRef> signature = {block.at(i)};
+                for (auto [c, b] : moves) {
+                    signature.push_back(c);
+                    signature.push_back(b);
+                }
+                refined.at(i) = signatures.insert({signature, signatures.size()}).first->second;
+            }
+
+            block = std::move(refined);
+            if (signatures.size() == numBlocks) {
+                return block;
+            }
+            numBlocks = signatures.size();
+        }
+    }
+
+    // merge states by block; -1 drops the state and its edges
+    BasicNFA quotient(std::vector<StateRef> const& block) const {
+        BasicNFA nfa;
+        auto numBlocks = *std::max_element(block.begin(), block.end()) + 1;
+        for (StateRef b = 0; b < numBlocks; ++b) {
+            nfa.addState();
+        }
+        nfa.setStart(block.at(m_start));
+
+        std::vector<std::set<std::pair<std::optional<Symbol>, StateRef>>> edges(numBlocks);
+        for (StateRef i = 0; i < m_states.size(); ++i) {
+            if (block.at(i) == -1) {
+                continue;
+            }
+            if (m_match.count(i)) {
+                nfa.m_match.insert(block.at(i));
+            }
+            for (auto& edge : m_states.at(i)) {
+                if (block.at(edge.second) != -1) {
+                    edges.at(block.at(i)).insert({edge.first, block.at(edge.second)});
+                }
+            }
+        }
+
+        for (StateRef b = 0; b < numBlocks; ++b) {
+            for (auto& [cond, to] : edges.at(b)) {
+                nfa.addEdge(b, cond, to);
+            }
+        }
+        return nfa;
+    }
+};
+
+using NFA = BasicNFA<char>;
+
+
+
+// JIT the DFA! WOMM
+enum class JitMode {
+    PerByte,  // load, compare and length-check one byte at a time
+    WideLoad, // load 8 bytes at once and check the length once per word
+};
+
+struct JitFunction {
+    // Symbol is the DFA's; jitted code takes input of that type (see Symbols)
+    template <typename Symbol>
+    JitFunction(BasicDFA<Symbol> const& dfa, JitMode mode = JitMode::PerByte) {
+        assert((mode == JitMode::PerByte || std::is_same_v<Symbol, char>) && "wide loads pack bytes");
+        TraceScope trace("jit");
+        std::string const type = cType<Symbol>();
+        m_filename = uniqueFilename(&dfa);
+        m_symbolSize = sizeof(Symbol);
+        {
+            TraceScope emit("jit.emit");
+            std::ofstream outs((m_filename + ".c").c_str());
+
+            if (mode == JitMode::WideLoad) {
+                if constexpr (std::is_same_v<Symbol, char>) {
+                    emitWideLoad(outs, dfa);
+                }
+            } else {
+                outs
+                << "int jitted(" << type << "* c, int len) { " << type << " ch;";
+                for (size_t i = 0; i < dfa.m_states.size(); ++i) {
+                    outs
+                    << std::endl
+                    << "state" << i << ":"
+                    << "if (!len) { return " << dfa.m_match.count(i) << "; }"
+                    << "ch = *c; ++c; --len;";
+
+                    for (auto& edge : dfa.m_states.at(i)) {
+                        outs << "if (ch == " << cSymbol(edge.first) << ") goto state" << edge.second << ";";
+                    }
+
+                    outs << "return 0;";
+                }
+                outs << "}" << std::endl;
+            }
+
+            // Budgeted, resumable variant.  Each state bails out to `check` at the end of a
+            // chunk; the outer loop there tests the budget and re-enters through a switch.
+            // Returns 0/1 for no match/match and 2 when the budget ran out.
+            outs
+            << "static const char accept[] = {";
+            for (size_t i = 0; i < dfa.m_states.size(); ++i) {
+                outs << dfa.m_match.count(i) << ",";
+            }
+            outs
+            << "0};" << std::endl
+            << "int jitted_resume(" << type << "* begin, long len, int* state, long* pos, long budget, int (*expired)(void*), void* ctx) {"
+            << type << " ch; " << type << "* c = begin + *pos; " << type << "* const stop = begin + len; " << type << "* end; long n; int s = *state;"
+            << std::endl
+            << "check:"
+            << "if (c == stop) { *pos = c - begin; *state = s; return accept[s]; }"
+            << "if (budget <= 0 || (expired && expired(ctx))) { *pos = c - begin; *state = s; return 2; }"
+            << "n = stop - c; if (n > " << MatchBudget::kCheckInterval << ") n = " << MatchBudget::kCheckInterval << "; if (n > budget) n = budget;"
+            << "end = c + n; budget -= n;"
+            << "switch (s) {";
+            for (size_t i = 0; i < dfa.m_states.size(); ++i) {
+                outs << "case " << i << ": goto state" << i << ";";
+            }
+            outs << "}";
+            for (size_t i = 0; i < dfa.m_states.size(); ++i) {
+                outs
+                << std::endl
+                << "state" << i << ":"
+                << "if (c == end) { s = " << i << "; goto check; }"
+                << "ch = *c; ++c;";
+
+                for (auto& edge : dfa.m_states.at(i)) {
+                    outs << "if (ch == " << cSymbol(edge.first) << ") goto state" << edge.second << ";";
+                }
+
+                outs << "*pos = c - begin - 1; *state = " << i << "; return 0;";
+            }
+            outs << "}" << std::endl;
+        }
+        m_start = dfa.m_start;
+
+        m_lib_handle = compileAndLoad(m_filename);
+        m_jitted = (decltype(m_jitted))symbol(m_lib_handle, "jitted");
+        m_jitted_resume = (decltype(m_jitted_resume))symbol(m_lib_handle, "jitted_resume");
+    }
+
+    // C spelling of Symbol and its values; chars stay character literals
+    template <typename Symbol>
+    static std::string cType() {
+        static_assert(std::is_integral_v<Symbol> && sizeof(Symbol) <= 4);
+        if constexpr (std::is_same_v<Symbol, char>) {
+            return "char";
+        } else {
+            return sizeof(Symbol) == 1 ? "unsigned char" : sizeof(Symbol) == 2 ? "unsigned short" : "unsigned int";
+        }
+    }
+
+    // a numeric constant, so quotes, backslashes, newlines and high bytes need no escaping
+    static std::string cSymbol(char c) {
+        char literal[16];
+        snprintf(literal, sizeof(literal), "(char)0x%02x", unsigned(uint8_t(c)));
+        return literal;
+    }
+
+    template <typename Symbol>
+    static std::string cSymbol(Symbol c) {
+        return std::to_string(std::make_unsigned_t<Symbol>(c)) + "u";
+    }
+
+    // Base name for a generated library.  The owner's address alone can repeat (e.g.
+    // temporaries), and dlopen() hands back the already loaded library for a path it has seen.
+    static std::string uniqueFilename(void const* owner) {
+        static std::atomic<int> counter{0};
+        return "jitfunc" + std::to_string((std::uintptr_t)owner) + "_" + std::to_string(getpid()) + "_" + std::to_string(counter++);
+    }
+
+    // Compile filename.c into a library and load it
+    static void* compileAndLoad(std::string const& filename) {
+        TraceScope trace("jit.compile");
+        std::system(std::string("gcc -O3 -dynamiclib -undefined suppress -flat_namespace " + filename + ".c -o " + filename + ".dylib").c_str());
+
+        // https://developer.apple.com/library/archive/documentation/DeveloperTools/Conceptual/DynamicLibraries/100-Articles/UsingDynamicLibraries.html
+        void* handle = dlopen(std::string(filename + ".dylib").c_str(), RTLD_LOCAL|RTLD_LAZY);
+
+        if (!handle) {
+            printf("[%s] Unable to load library: %s\n", __FILE__, dlerror());
+            exit(EXIT_FAILURE);
+        }
+        return handle;
+    }
+
+    static void* symbol(void* handle, char const* name) {
+        void* sym = dlsym(handle, name);
+
+        if (!sym) {
+            printf("[%s] Unable to get symbol: %s\n", __FILE__, dlerror());
+            exit(EXIT_FAILURE);
+        }
+        return sym;
+    }
+
+    static void unload(void* handle, std::string const& filename) {
+        if (dlclose(handle) != 0) {
+            printf("[%s] Problem closing library: %s", __FILE__, dlerror());
+        }
+        std::system(std::string("rm -f " + filename + ".c " + filename + ".dylib").c_str());
+    }
+
+    static size_t codeSize(std::string const& filename) {
+        struct stat st;
+        return stat((filename + ".dylib").c_str(), &st) == 0 ? st.st_size : 0;
+    }
+
+    // Every state gets eight unrolled blocks, one per byte of a 64-bit word, plus a load
+    // block (the only length check on the fast path) and a per-byte tail for the last
+    // len % 8 bytes.
+    static void emitWideLoad(std::ostream& outs, DFA const& dfa) {
+        outs
+        << "#include <string.h>" << std::endl
+        << "int jitted(char* c, int len) { unsigned long long w; char ch;"
+        << "goto state" << dfa.m_start << "_load;";
+        for (size_t i = 0; i < dfa.m_states.size(); ++i) {
+            auto transitions = [&](std::string const& next) {
+                for (auto& edge : dfa.m_states.at(i)) {
+                    outs << "if (ch == " << cSymbol(edge.first) << ") goto state" << edge.second << next << ";";
+                }
+                outs << "return 0;";
+            };
+
+            outs
+            << std::endl
+            << "state" << i << "_load:"
+            << "if (len < 8) goto state" << i << "_tail;"
+            << "memcpy(&w, c, 8); c += 8; len -= 8;"
+            << std::endl
+            << "#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__" << std::endl
+            << "w = __builtin_bswap64(w);" << std::endl
+            << "#endif" << std::endl;
+            for (int k = 0; k < 8; ++k) {
+                outs << "state" << i << "_" << k << ":" << "ch = (char)(w >> " << 8 * k << ");";
+                transitions(k == 7 ? "_load" : "_" + std::to_string(k + 1));
+                outs << std::endl;
+            }
+
+            outs
+            << "state" << i << "_tail:"
+            << "if (!len) { return " << dfa.m_match.count(i) << "; }"
+            << "ch = *c; ++c; --len;";
+            transitions("_tail");
+        }
+        outs << "}" << std::endl;
+    }
+
+    ~JitFunction() {
+        unload(m_lib_handle, m_filename);
+    }
+
+    bool operator()(std::string_view const sv) {
+        assert(m_jitted && m_symbolSize == 1);
+        return m_jitted(sv.data(), (int)sv.size());
+    }
+
+    template <typename Symbol>
+    bool operator()(std::span<Symbol const> const symbols) {
+        assert(m_jitted && m_symbolSize == sizeof(Symbol));
+        return m_jitted(symbols.data(), (int)symbols.size());
+    }
+
+    BudgetedMatch<int> operator()(std::string_view const sv, MatchBudget const& budget) {
+        return resume(sv, {MatchStatus::BudgetExceeded, 0, m_start}, budget);
+    }
+
+    BudgetedMatch<int> resume(std::string_view const sv, BudgetedMatch<int> from, MatchBudget const& budget) {
+        assert(m_jitted_resume && m_symbolSize == 1);
+        auto expired = [](void* ctx) {
+            auto deadline = static_cast<MatchBudget const*>(ctx)->deadline;
+            return int(deadline && std::chrono::steady_clock::now() >= *deadline);
+        };
+        long pos = from.pos;
+        long bytes = std::min<size_t>(budget.bytes, LONG_MAX);
+        int result = m_jitted_resume(sv.data(), (long)sv.size(), &from.state, &pos, bytes,
+            budget.deadline ? +expired : nullptr, (void*)&budget);
+        return {MatchStatus(result), size_t(pos), from.state};
+    }
+
+    // code is the size of the loaded library, which is mostly the jitted function
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        usage.states = sizeof(*this) + m_filename.capacity();
+        usage.code = codeSize(m_filename);
+        return usage;
+    }
+
+    // declared over void so one type fits every Symbol; the generated code has the real one
+    int (*m_jitted)(void const* c, int len);
+    int (*m_jitted_resume)(void const* begin, long len, int* state, long* pos, long budget, int (*expired)(void*), void* ctx);
+    int m_start;
+    size_t m_symbolSize;
+    std::string m_filename;
+    void* m_lib_handle;
+};
+
+
+// Re-matches an edited document without rescanning all of it.  The DFA state is saved at
+// checkpoints through the text; an edit restarts from the last checkpoint before it and
+// stops as soon as the new run reaches a checkpoint past the edit in the same state as
+// before, since everything after that is unchanged.  Cost is proportional to the edit
+// (plus up to `interval` bytes), not the document.
+struct IncrementalScanner {
+    IncrementalScanner(FrozenDFA dfa, std::string text, size_t interval = 256)
+        : m_dfa(std::move(dfa)), m_text(std::move(text)), m_interval(interval) {
+        m_checkpoints.push_back({0, m_dfa.m_start});
+        rescan(/*editEnd*/0, {});
+    }
+
+    // Replace `removed` bytes at pos with `inserted`
+    void edit(size_t pos, size_t removed, std::string_view const inserted) {
+        TraceScope trace("incremental.edit", "match");
+        assert(pos + removed <= m_text.size());
+        m_text.replace(pos, removed, inserted);
+
+        // checkpoints up to the edit stay; those after the removed bytes shift with the text
+        auto firstStale = std::upper_bound(m_checkpoints.begin(), m_checkpoints.end(), pos, [](size_t p, Checkpoint const& cp) {
+            return p < cp.pos;
+        });
+        std::vector<Checkpoint> tail;
+        for (auto it = firstStale; it != m_checkpoints.end(); ++it) {
+            if (it->pos >= pos + removed) {
+                tail.push_back({it->pos - removed + inserted.size(), it->state});
+            }
+        }
+        m_checkpoints.erase(firstStale, m_checkpoints.end());
+
+        rescan(pos + inserted.size(), std::move(tail));
+    }
+
+    bool matches() const {
+        return m_finalState != -1 && m_dfa.isMatch(m_finalState);
+    }
+
+    std::string const& text() const {
+        return m_text;
+    }
+
+    // bytes stepped through by the last edit (or the initial scan)
+    size_t lastRescanned() const {
+        return m_lastRescanned;
+    }
+
+    size_t numCheckpoints() const {
+        return m_checkpoints.size();
+    }
+
+private:
+    struct Checkpoint {
+        size_t pos;              // state after text[0, pos)
+        FrozenDFA::StateRef state; // -1 once dead
+    };
+
+    // Scan from the last checkpoint.  Within the edited region new checkpoints go every
+    // m_interval bytes; past editEnd the old (shifted) checkpoints are reused, and the scan
+    // stops at the first one whose state we reproduce.
+    void rescan(size_t editEnd, std::vector<Checkpoint> tail) {
+        auto state = m_checkpoints.back().state;
+        size_t pos = m_checkpoints.back().pos;
+        size_t const start = pos;
+        size_t nextInterval = pos + m_interval;
+        size_t t = 0;
+
+        for (;; ++pos) {
+            if (t < tail.size() && tail[t].pos == pos) {
+                if (tail[t].state == state) {
+                    m_checkpoints.insert(m_checkpoints.end(), tail.begin() + t, tail.end());
+                    m_lastRescanned = pos - start;
+                    return;
+                }
+                m_checkpoints.push_back({pos, state});
+                ++t;
+            } else if (pos >= nextInterval && (pos < editEnd || t == tail.size())) {
+                m_checkpoints.push_back({pos, state});
+                nextInterval = pos + m_interval;
+            }
+            if (pos == m_text.size()) {
+                break;
+            }
+            if (state != -1) {
+                state = m_dfa.next(state, m_text[pos]);
+            }
+        }
+        m_finalState = state;
+        m_lastRescanned = pos - start;
+    }
+
+    FrozenDFA m_dfa;
+    std::string m_text;
+    size_t m_interval;
+    std::vector<Checkpoint> m_checkpoints;
+    FrozenDFA::StateRef m_finalState = -1;
+    size_t m_lastRescanned = 0;
+};
+
+// Runs a FrozenDFA over an LZ4 block (raw block format, no frame) without stepping through
+// every decompressed byte.  Literal runs are stepped normally.  A match copies earlier output,
+// so its effect on the DFA is the composition of the transition functions of the pieces it
+// copies: pieces get a state->state map once they are copied (see wantMap), and later
+// copies apply that map in one lookup.  Overlapping copies, the partial pieces at either end of a
+// copy and everything past the map budget fall back to stepping bytes.  The output itself is
+// still materialized because copies are resolved against it, but a memcpy is far cheaper
+// than a DFA step.
+struct LZ4Scanner {
+    using StateRef = FrozenDFA::StateRef;
+    static constexpr size_t kMinMapLength = 16; // shorter pieces are cheaper to step
+    // A map costs a walk per DFA state, so it is only built for pieces at least this many
+    // times longer than the DFA has states; otherwise stepping the bytes is cheaper.
+    static constexpr size_t kMinLengthPerState = 1;
+
+    struct Stats {
+        size_t stepped = 0;  // bytes pushed through the DFA, including while building maps
+        size_t composed = 0; // input bytes skipped by applying a map
+        size_t maps = 0;
+    };
+
+    LZ4Scanner(FrozenDFA dfa, size_t mapBudget = 16 << 20) : m_dfa(std::move(dfa)), m_mapBudget(mapBudget) {
+    }
+
+    // Blocks are untrusted input: a malformed one (see malformed()) doesn't match
+    bool testMatch(std::string_view const block) {
+        TraceScope trace("lz4.scan", "match");
+        m_out.clear();
+        m_pieces.clear();
+        m_mapBytes = 0;
+        m_stats = {};
+        m_malformed = false;
+
+        size_t i = 0;
+        auto length = [&](size_t n) {
+            if (n == 15) {
+                uint8_t b;
+                do {
+                    if (i == block.size()) {
+                        m_malformed = true; // truncated length
+                        return n;
+                    }
+                    b = block[i++];
+                    n += b;
+                } while (b == 255);
+            }
+            return n;
+        };
+
+        StateRef state = m_dfa.m_start;
+        while (i < block.size()) {
+            uint8_t const token = block[i++];
+
+            size_t const literals = length(token >> 4);
+            if (m_malformed || literals > block.size() - i) {
+                m_malformed = true; // literals run past the end
+                return false;
+            }
+            if (literals) {
+                size_t const start = m_out.size();
+                m_out.append(block.substr(i, literals));
+                i += literals;
+                state = step(state, start, m_out.size());
+                m_pieces.push_back({start, literals, SIZE_MAX, 0, {}});
+            }
+            if (i == block.size() || state == -1) {
+                break; // the last sequence has no match
+            }
+
+            if (block.size() - i < 2) {
+                m_malformed = true; // truncated offset
+                return false;
+            }
+            size_t const offset = uint8_t(block[i]) | uint8_t(block[i + 1]) << 8;
+            i += 2;
+            size_t const matchLength = length(token & 15) + 4;
+            if (m_malformed || !offset || offset > m_out.size()) {
+                m_malformed = true; // truncated length, or a copy from before the output
+                return false;
+            }
+
+            size_t const start = m_out.size();
+            size_t const src = start - offset;
+            m_out.resize(start + matchLength);
+            if (offset >= matchLength) {
+                memcpy(&m_out[start], &m_out[src], matchLength);
+                state = walk(state, src, src + matchLength, /*build*/true);
+                m_pieces.push_back({start, matchLength, src, 0, {}});
+            } else {
+                // overlapping copy repeats its own output, so there is nothing to compose
+                for (size_t k = 0; k < matchLength; ++k) {
+                    m_out[start + k] = m_out[src + k];
+                }
+                state = step(state, start, start + matchLength);
+                m_pieces.push_back({start, matchLength, SIZE_MAX, 0, {}});
+            }
+            if (state == -1) {
+                break;
+            }
+        }
+
+        return state != -1 && m_dfa.isMatch(state);
+    }
+
+    Stats const& stats() const {
+        return m_stats;
+    }
+
+    // whether the last testMatch() gave up on a malformed block
+    bool malformed() const {
+        return m_malformed;
+    }
+
+private:
+    struct Piece {
+        size_t start;
+        size_t length;
+        size_t src = SIZE_MAX; // copied from here, or SIZE_MAX for literal bytes
+        int uses = 0;
+        std::vector<StateRef> map; // empty until built
+    };
+
+    StateRef step(StateRef state, size_t from, size_t to) {
+        for (; from < to && state != -1; ++from) {
+            state = m_dfa.next(state, m_out[from]);
+            ++m_stats.stepped;
+        }
+        return state;
+    }
+
+    // DFA state after m_out[from, to), applying the maps of the whole pieces in between
+    StateRef walk(StateRef state, size_t from, size_t to, bool build) {
+        auto it = std::upper_bound(m_pieces.begin(), m_pieces.end(), from, [](size_t pos, Piece const& piece) {
+            return pos < piece.start;
+        });
+        for (--it; from < to && state != -1; ++it) {
+            size_t const end = it->start + it->length;
+            if (from == it->start && end <= to && (!it->map.empty() || (build && wantMap(*it) && buildMap(*it)))) {
+                state = it->map[state];
+                m_stats.composed += build ? it->length : 0;
+                from = end;
+            } else {
+                state = step(state, from, std::min(end, to));
+                from = std::min(end, to);
+            }
+        }
+        return state;
+    }
+
+    // Mapping a copy costs a walk over its source per state, and the walk that created it
+    // already mapped the whole pieces it copied, so that is cheap from the first reference.
+    // Literal bytes must be stepped once per state, which only pays off when they repeat.
+    bool wantMap(Piece& piece) {
+        return ++piece.uses >= (piece.src == SIZE_MAX ? 2 : 1);
+    }
+
+    bool buildMap(Piece& piece) {
+        size_t const bytes = m_dfa.numStates() * sizeof(StateRef);
+        if (piece.length < kMinMapLength || piece.length < m_dfa.numStates() * kMinLengthPerState
+            || m_mapBytes + bytes > m_mapBudget) {
+            return false;
+        }
+        piece.map.resize(m_dfa.numStates());
+        for (StateRef s = 0; s < StateRef(m_dfa.numStates()); ++s) {
+            piece.map[s] = piece.src == SIZE_MAX ? step(s, piece.start, piece.start + piece.length)
+                                                 : walk(s, piece.src, piece.src + piece.length, /*build*/false);
+        }
+        m_mapBytes += bytes;
+        ++m_stats.maps;
+        return true;
+    }
+
+    FrozenDFA m_dfa;
+    size_t m_mapBudget;
+    size_t m_mapBytes = 0;
+    std::string m_out;
+    std::vector<Piece> m_pieces; // in output order, covering m_out
+    Stats m_stats;
+    bool m_malformed = false;
+};
+
+// JIT for DFAs too big to compile whole: only the states hottest in a profile are compiled,
+// as many as fit a code-size budget, and the rest run from the frozen table.  Jitted code
+// returns to the table loop when it steps into a cold state, and the loop re-enters the
+// jitted code as soon as it reaches a hot one.
+struct HybridJit {
+    // rough machine code per state and per transition, for the budget
+    static constexpr size_t kBytesPerState = 24;
+    static constexpr size_t kBytesPerEdge = 12;
+
+    HybridJit(DFA const& dfa, std::vector<uint64_t> const& visits, size_t codeBudget)
+        : m_table(dfa.freeze()), m_hot(dfa.m_states.size()) {
+        TraceScope trace("hybridJit");
+        std::vector<DFA::StateRef> order(dfa.m_states.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](auto a, auto b) {
+            return visits.at(a) > visits.at(b);
+        });
+        size_t used = 0;
+        for (auto state : order) {
+            size_t cost = kBytesPerState + kBytesPerEdge * dfa.m_states.at(state).size();
+            if (visits.at(state) && used + cost <= codeBudget) {
+                m_hot[state] = true;
+                used += cost;
+                ++m_numHot;
+            }
+        }
+
+        m_filename = JitFunction::uniqueFilename(this);
+        {
+            // Runs hot states from *state; stops at the end of input, at a dead end (*state
+            // = -1) or on entering a cold state (*state = that state).  Returns bytes consumed.
+            std::ofstream outs((m_filename + ".c").c_str());
+            outs
+            << "long jitted_hot(char* begin, long len, int* state) {"
+            << "char* c = begin; char* const end = begin + len; char ch;"
+            << "switch (*state) {";
+            for (size_t i = 0; i < dfa.m_states.size(); ++i) {
+                if (m_hot[i]) {
+                    outs << "case " << i << ": goto state" << i << ";";
+                }
+            }
+            outs << "default: return 0; }";
+            for (size_t i = 0; i < dfa.m_states.size(); ++i) {
+                if (!m_hot[i]) {
+                    continue;
+                }
+                outs
+                << std::endl
+                << "state" << i << ":"
+                << "if (c == end) { *state = " << i << "; return c - begin; }"
+                << "ch = *c; ++c;";
+
+                for (auto& edge : dfa.m_states.at(i)) {
+                    outs << "if (ch == " << JitFunction::cSymbol(edge.first) << ") ";
+                    if (m_hot[edge.second]) {
+                        outs << "goto state" << edge.second << ";";
+                    } else {
+                        outs << "{ *state = " << edge.second << "; return c - begin; }";
+                    }
+                }
+
+                outs << "*state = -1; return c - begin;";
+            }
+            outs << "}" << std::endl;
+        }
+
+        m_lib_handle = JitFunction::compileAndLoad(m_filename);
+        m_jitted_hot = (decltype(m_jitted_hot))JitFunction::symbol(m_lib_handle, "jitted_hot");
+    }
+
+    HybridJit(HybridJit const&) = delete;
+    HybridJit& operator=(HybridJit const&) = delete;
+
+    ~HybridJit() {
+        JitFunction::unload(m_lib_handle, m_filename);
+    }
+
+    bool operator()(std::string_view const sv) const {
+        int state = m_table.m_start;
+        size_t pos = 0;
+        while (pos < sv.size()) {
+            if (m_hot[state]) {
+                pos += m_jitted_hot((char*)sv.data() + pos, sv.size() - pos, &state);
+            } else {
+                state = m_table.next(state, sv[pos++]);
+            }
+            if (state == -1) {
+                return false;
+            }
+        }
+        return m_table.isMatch(state);
+    }
+
+    size_t numHot() const {
+        return m_numHot;
+    }
+
+    MemoryUsage memoryUsage() const {
+        auto usage = m_table.memoryUsage();
+        usage.tables += MemoryUsage::bytes(m_hot);
+        usage.code = JitFunction::codeSize(m_filename);
+        return usage;
+    }
+
+private:
+    FrozenDFA m_table;
+    std::vector<bool> m_hot;
+    size_t m_numHot = 0;
+    long (*m_jitted_hot)(char* begin, long len, int* state);
+    std::string m_filename;
+    void* m_lib_handle;
+};
+
+struct Benchmark {
+    std::vector<std::string> tests;
+
+    Benchmark(std::vector<std::string> cases, int count = 1000000) {
+        srand(0);
+        for (int i = 0; i < count; ++i) {
+            tests.push_back(cases.at(rand() % cases.size()));
+        }
+    }
+
+    template <typename Func>
+    int operator()(Func func) const {
+        struct TimedScope {
+            TimedScope() {
+                start = std::chrono::steady_clock::now();
+            }
+
+            ~TimedScope() {
+                auto stop = std::chrono::steady_clock::now();
+                std::cout << "elapsed time: " << std::chrono::duration<double, std::milli>(stop - start).count() << "ms" << std::endl;
+            }
+            std::chrono::time_point<std::chrono::steady_clock> start;
+        };
+
+        int count = 0;
+        {
+            TimedScope timer;
+            for (auto& test : tests) {
+                count += func(test);
+            }
+        }
+        return count;
+    }
+};
+
+// Boolean query over trigrams, as in https://swtch.com/~rsc/regexp/regexp4.html.  An And
+// node needs all of its trigrams and subqueries, an Or node any one of them.
+struct TrigramQuery {
+    enum class Op { All, None, And, Or };
+
+    Op op = Op::All;
+    std::set<std::string> trigrams;
+    std::vector<TrigramQuery> subs;
+
+    static TrigramQuery all() {
+        return {};
+    }
+
+    static TrigramQuery none() {
+        TrigramQuery q;
+        q.op = Op::None;
+        return q;
+    }
+
+    // every trigram of str (no constraint if str is too short to have one)
+    static TrigramQuery allOf(std::string const& str) {
+        TrigramQuery q;
+        for (size_t i = 0; i + 3 <= str.size(); ++i) {
+            q.op = Op::And;
+            q.trigrams.insert(str.substr(i, 3));
+        }
+        return q;
+    }
+
+    // a document containing any of strs
+    static TrigramQuery anyOf(std::set<std::string> const& strs) {
+        auto q = none();
+        for (auto& str : strs) {
+            q = q || allOf(str);
+        }
+        return q;
+    }
+
+    bool operator==(TrigramQuery const& other) const = default;
+
+    friend TrigramQuery operator&&(TrigramQuery x, TrigramQuery y) {
+        return combine(Op::And, std::move(x), std::move(y));
+    }
+
+    friend TrigramQuery operator||(TrigramQuery x, TrigramQuery y) {
+        return combine(Op::Or, std::move(x), std::move(y));
+    }
+
+    std::string toStr() const {
+        switch (op) {
+        case Op::All:
+            return "ALL";
+        case Op::None:
+            return "NONE";
+        default:
+            std::string out;
+            auto sep = op == Op::And ? " " : " | ";
+            for (auto& trigram : trigrams) {
+                out += (out.empty() ? "" : sep) + ("\"" + trigram + "\"");
+            }
+            for (auto& sub : subs) {
+                out += (out.empty() ? "" : sep) + ("(" + sub.toStr() + ")");
+            }
+            return out;
+        }
+    }
+
+private:
+    static TrigramQuery combine(Op op, TrigramQuery x, TrigramQuery y) {
+        // All/None absorb or vanish depending on the operator
+        auto absorbing = op == Op::And ? Op::None : Op::All;
+        auto identity = op == Op::And ? Op::All : Op::None;
+        if (x.op == absorbing || y.op == identity) {
+            return x;
+        }
+        if (y.op == absorbing || x.op == identity) {
+            return y;
+        }
+
+        TrigramQuery q;
+        q.op = op;
+        for (auto* side : {&x, &y}) {
+            if (side->op == op || side->trigrams.size() + side->subs.size() == 1) {
+                q.trigrams.insert(side->trigrams.begin(), side->trigrams.end());
+                for (auto& sub : side->subs) {
+                    q.addSub(std::move(sub));
+                }
+            } else {
+                q.addSub(std::move(*side));
+            }
+        }
+        if (q.trigrams.empty() && q.subs.size() == 1) {
+            return std::move(q.subs.front());
+        }
+        return q;
+    }
+
+    // skip subqueries we already have; they come up a lot since prefix, suffix and exact
+    // sets often describe the same strings
+    void addSub(TrigramQuery sub) {
+        if (std::find(subs.begin(), subs.end(), sub) == subs.end()) {
+            subs.push_back(std::move(sub));
+        }
+    }
+};
+
+// What a combinator tells us about the strings it matches, for deriving a TrigramQuery.
+// prefix/suffix hold at most kMaxSet strings of at most three characters; "" means no
+// constraint.  exact is every matched string, while there are few enough of them.
+struct TrigramInfo {
+    static constexpr size_t kMaxExact = 16;
+    static constexpr size_t kMaxSet = 16;
+
+    using strset = std::set<std::string>;
+
+    bool emptyable = false;
+    std::optional<strset> exact;
+    strset prefix;
+    strset suffix;
+    TrigramQuery match;
+
+    // all of the above folded into one query
+    TrigramQuery query() const {
+        auto q = match && TrigramQuery::anyOf(prefix) && TrigramQuery::anyOf(suffix);
+        if (exact) {
+            q = q && TrigramQuery::anyOf(*exact);
+        }
+        return q;
+    }
+
+    static TrigramInfo literal(char c) {
+        TrigramInfo info;
+        info.exact = strset{std::string({c})};
+        info.prefix = info.suffix = *info.exact;
+        return info;
+    }
+
+    static TrigramInfo concat(TrigramInfo const& a, TrigramInfo const& b) {
+        TrigramInfo info;
+        info.emptyable = a.emptyable && b.emptyable;
+        if (a.exact && b.exact && a.exact->size() * b.exact->size() <= kMaxExact) {
+            info.exact = cross(*a.exact, *b.exact);
+        }
+        if (a.exact) {
+            info.prefix = trim(cross(*a.exact, b.prefix), /*keepFront*/true);
+        } else {
+            info.prefix = a.emptyable ? merge(a.prefix, b.prefix, true) : a.prefix;
+        }
+        if (b.exact) {
+            info.suffix = trim(cross(a.suffix, *b.exact), /*keepFront*/false);
+        } else {
+            info.suffix = b.emptyable ? merge(a.suffix, b.suffix, false) : b.suffix;
+        }
+        info.match = a.query() && b.query() && TrigramQuery::anyOf(cross(a.suffix, b.prefix));
+        return info;
+    }
+
+    static TrigramInfo alternate(TrigramInfo const& a, TrigramInfo const& b) {
+        TrigramInfo info;
+        info.emptyable = a.emptyable || b.emptyable;
+        if (a.exact && b.exact && a.exact->size() + b.exact->size() <= kMaxExact) {
+            info.exact = *a.exact;
+            info.exact->insert(b.exact->begin(), b.exact->end());
+        }
+        info.prefix = merge(a.prefix, b.prefix, true);
+        info.suffix = merge(a.suffix, b.suffix, false);
+        info.match = a.query() || b.query();
+        return info;
+    }
+
+    static TrigramInfo optional(TrigramInfo const& a) {
+        TrigramInfo info;
+        info.emptyable = true;
+        if (a.exact && a.exact->size() < kMaxExact) {
+            info.exact = *a.exact;
+            info.exact->insert("");
+        }
+        info.prefix = info.suffix = {""};
+        return info;
+    }
+
+    static TrigramInfo repeat(TrigramInfo const& a) {
+        TrigramInfo info;
+        info.emptyable = a.emptyable;
+        info.prefix = a.prefix;
+        info.suffix = a.suffix;
+        info.match = a.query();
+        return info;
+    }
+
+private:
+    static strset cross(strset const& x, strset const& y) {
+        strset out;
+        for (auto& a : x) {
+            for (auto& b : y) {
+                out.insert(a + b);
+            }
+        }
+        return out;
+    }
+
+    static strset merge(strset const& x, strset const& y, bool keepFront) {
+        strset out = x;
+        out.insert(y.begin(), y.end());
+        return trim(out, keepFront);
+    }
+
+    // cut strings to three characters, then shorter until the set is small enough
+    static strset trim(strset const& strs, bool keepFront) {
+        for (size_t len = 3;; --len) {
+            strset out;
+            for (auto& str : strs) {
+                auto n = std::min(len, str.size());
+                out.insert(keepFront ? str.substr(0, n) : str.substr(str.size() - n));
+            }
+            if (out.size() <= kMaxSet || len == 0) {
+                return out;
+            }
+        }
+    }
+};
+
+// Helpers to make regex/NFA from parser
+
+struct Char {
+    Char(char c) : c(c) {};
+    char c;
+
+    std::string toStr() const {
+        return std::string({c});
+    }
+
+    TrigramInfo trigrams() const {
+        return TrigramInfo::literal(c);
+    }
+
+    NFA toNFA() const {
+        NFA nfa;
+
+        auto start = nfa.addState();
+        nfa.setStart(start);
+
+        auto match = nfa.addState();
+        nfa.addMatch(match);
+
+        nfa.addEdge(start, c, match);
+
+        return nfa;
+    }
+};
+
+// insert src into dst at dstref.  Creates a state that indicates a match of src in dst, and returns a ref.
+NFA::StateRef merge(NFA& dst, NFA::StateRef dstref, NFA&& src) {
+    TraceScope trace("merge");
+    // this map could just be addition but this is fine
+    std::unordered_map</*src*/ NFA::StateRef, /*dst*/NFA::StateRef> newEdges;
+    for (NFA::StateRef i = 0; i < src.m_states.size(); ++i) {
+        newEdges[i] = dst.addState();
+    }
+
+    for (NFA::StateRef i = 0; i < src.m_states.size(); ++i) {
+        for (auto& edge : src.m_states.at(i)) {
+            dst.addEdge(newEdges.at(i), edge.first, newEdges.at(edge.second));
+        }
+    }
+
+    for (auto [state, slot] : src.m_tags) {
+        dst.addTag(newEdges.at(state), slot);
+    }
+
+    // map dstRef to the start node
+    dst.addEdge(dstref, std::nullopt, newEdges.at(src.m_start));
+
+    // map the matching nodes to one node
+    auto matchsrc = dst.addState();
+
+    for (auto srcstate : src.m_match) {
+        dst.addEdge(newEdges.at(srcstate), std::nullopt, matchsrc);
+    }
+
+    return matchsrc;
+}
+
+template <typename A, typename B>
+struct And {
+    And(A a, B b) : a(a), b(b) {}
+    A a;
+    B b;
+
+    std::string toStr() const {
+        return a.toStr() + b.toStr();
+    }
+
+    TrigramInfo trigrams() const {
+        return TrigramInfo::concat(a.trigrams(), b.trigrams());
+    }
+
+    NFA toNFA() const {
+        NFA nfa;
+
+        auto start = nfa.addState();
+        nfa.setStart(start);
+
+        auto mid = merge(nfa, start, a.toNFA());
+        auto match = merge(nfa, mid, b.toNFA());
+
+        nfa.addMatch(match);
+
+        return nfa;
+    }
+};
+
+template <typename A, typename B>
+struct Or {
+    Or(A a, B b) : a(a), b(b) {}
+    A a;
+    B b;
+
+    // The whole alternation is parenthesized as well as each side: | binds loosest, so the
+    // old "(a)|(b)" put anything concatenated onto it in one branch, e.g. x(a|b) printed
+    // as "x(a)|(b)", which std::regex and the baseline libraries read as (xa)|b.
+    std::string toStr() const {
+        return "((" + a.toStr() + ")|(" + b.toStr() + "))";
+    }
+
+    TrigramInfo trigrams() const {
+        return TrigramInfo::alternate(a.trigrams(), b.trigrams());
+    }
+
+    NFA toNFA() const {
+        NFA nfa;
+
+        auto start = nfa.addState();
+        nfa.setStart(start);
+
+        auto matcha = merge(nfa, start, a.toNFA());
+        auto matchb = merge(nfa, start, b.toNFA());
+
+        nfa.addMatch(matcha);
+        nfa.addMatch(matchb);
+
+        return nfa;
+    }
+};
+
+template <typename A>
 struct Maybe {
     Maybe(A a) : a(a) {}
     A a;
 
-    std::string toStr() const {
-        return "(" + a.toStr() + ")?";
+    std::string toStr() const {
+        return "(" + a.toStr() + ")?";
+    }
+
+    TrigramInfo trigrams() const {
+        return TrigramInfo::optional(a.trigrams());
+    }
+
+    NFA toNFA() const {
+        NFA nfa;
+
+        auto start = nfa.addState();
+        nfa.setStart(start);
+
+        auto matchit = merge(nfa, start, a.toNFA());
+
+        nfa.addMatch(matchit);
+        nfa.addEdge(start, std::nullopt, matchit);
+
+        return nfa;
+    }
+};
+
+template <typename A>
+struct OneOrMore {
+    OneOrMore(A a) : a(a) {}
+    A a;
+
+    std::string toStr() const {
+        return "(" + a.toStr() + ")+";
+    }
+
+    TrigramInfo trigrams() const {
+        return TrigramInfo::repeat(a.trigrams());
+    }
+
+    NFA toNFA() const {
+        NFA nfa;
+
+        auto start = nfa.addState();
+        nfa.setStart(start);
+
+        auto matchit = merge(nfa, start, a.toNFA());
+
+        nfa.addMatch(matchit);
+        nfa.addEdge(matchit, std::nullopt, start);
+
+        return nfa;
+    }
+};
+
+// Group `index` (>= 1) of a match: its start and end positions are recorded in capture
+// slots 2 * index and 2 * index + 1.  Only BitState reports captures.
+template <typename A>
+struct Capture {
+    Capture(int index, A a) : index(index), a(a) {}
+    int index;
+    A a;
+
+    std::string toStr() const {
+        return "(" + a.toStr() + ")";
+    }
+
+    TrigramInfo trigrams() const {
+        return a.trigrams();
+    }
+
+    NFA toNFA() const {
+        NFA nfa;
+
+        auto start = nfa.addState();
+        nfa.setStart(start);
+        nfa.addTag(start, 2 * index);
+
+        auto matchit = merge(nfa, start, a.toNFA());
+        nfa.addTag(matchit, 2 * index + 1);
+
+        nfa.addMatch(matchit);
+
+        return nfa;
+    }
+};
+
+// Bounded backtracking over an NFA, after RE2's BitState.  A bitmap of visited
+// (state, position) pairs makes it linear in states x input length, and with no setup
+// beyond clearing that bitmap it beats the other engines on short inputs.  Reports capture
+// positions; explores edges in order, so the first successful path wins.
+struct BitState {
+    // bitmaps up to this size live on the stack
+    static constexpr size_t kStackBits = 32 * 1024;
+    // and past this one (8MB) match() leaves it to the NFA simulation
+    static constexpr size_t kMaxBits = size_t(64) << 20;
+
+    explicit BitState(NFA const& nfa) : m_nfa(nfa) {
+        int slots = 2;
+        for (auto [state, slot] : nfa.m_tags) {
+            slots = std::max(slots, slot + 1);
+        }
+        m_numSlots = (slots + 1) & ~1;
+    }
+
+    static bool fitsOnStack(size_t numStates, size_t len) {
+        return numStates * (len + 1) <= kStackBits;
+    }
+
+    static bool fits(size_t numStates, size_t len) {
+        return len < kMaxBits && numStates * (len + 1) <= kMaxBits;
+    }
+
+    size_t numGroups() const {
+        return m_numSlots / 2;
+    }
+
+    // Full match of sv.  On success captures (if given) holds numGroups() start/end pairs,
+    // -1 for groups that didn't take part; group 0 is the whole input.  Inputs too long
+    // for the bitmap (see fits()) are matched by the NFA and leave captures empty.
+    bool match(std::string_view const sv, std::vector<int>* captures = nullptr) const {
+        if (!fits(m_nfa.numStates(), sv.size())) {
+            if (captures) {
+                captures->clear();
+            }
+            return m_nfa.testMatch(sv);
+        }
+        size_t bits = m_nfa.numStates() * (sv.size() + 1);
+        if (fitsOnStack(m_nfa.numStates(), sv.size())) {
+            uint64_t visited[kStackBits / 64];
+            std::fill(visited, visited + (bits + 63) / 64, 0);
+            return search(sv, visited, captures);
+        }
+        std::vector<uint64_t> visited((bits + 63) / 64);
+        return search(sv, visited.data(), captures);
+    }
+
+private:
+    using StateRef = NFA::StateRef;
+
+    // A state to explore at a position, or (state < 0) a capture slot to put back, its old
+    // value in pos.  Positions are below kMaxBits, so slots hold them as int.
+    struct Job {
+        StateRef state;
+        size_t pos;
+    };
+
+    bool search(std::string_view const sv, uint64_t* visited, std::vector<int>* captures) const {
+        std::vector<int> slots(m_numSlots, -1);
+        std::vector<Job> stack = {{m_nfa.m_start, 0}};
+        size_t const len = sv.size();
+
+        while (!stack.empty()) {
+            auto job = stack.back();
+            stack.pop_back();
+
+            if (job.state < 0) {
+                slots.at(-job.state - 1) = int(job.pos);
+                continue;
+            }
+
+            size_t bit = size_t(job.state) * (len + 1) + job.pos;
+            if (visited[bit / 64] & (uint64_t(1) << (bit % 64))) {
+                continue;
+            }
+            visited[bit / 64] |= uint64_t(1) << (bit % 64);
+
+            auto tag = m_nfa.m_tags.find(job.state);
+            if (tag != m_nfa.m_tags.end()) {
+                stack.push_back({-tag->second - 1, size_t(slots.at(tag->second))});
+                slots.at(tag->second) = int(job.pos);
+            }
+
+            if (job.pos == len && m_nfa.isMatch(job.state)) {
+                if (captures) {
+                    slots[0] = 0;
+                    slots[1] = int(len);
+                    *captures = std::move(slots);
+                }
+                return true;
+            }
+
+            // pushed in reverse so the first edge is tried first
+            auto& edges = m_nfa.m_states.at(job.state);
+            for (auto it = edges.rbegin(); it != edges.rend(); ++it) {
+                if (!it->first) {
+                    stack.push_back({it->second, job.pos});
+                } else if (job.pos < len && sv[job.pos] == *it->first) {
+                    stack.push_back({it->second, job.pos + 1});
+                }
+            }
+        }
+        return false;
+    }
+
+    NFA const& m_nfa;
+    int m_numSlots;
+};
+
+// ShortVerifier is what the DFA engine runs for patterns ShortVerifier::compile() accepts
+enum class Engine { NFA, DFA, JIT, BitState, ShortVerifier, Count };
+
+inline char const* engineName(Engine engine) {
+    static char const* const names[] = {"NFA", "DFA", "JIT", "BitState", "ShortVerifier"};
+    return names[int(engine)];
+}
+
+// The code one match call ran: its engine, and the JitMode of the JIT or else the SIMD tier
+// of the kernels behind the feasibility filter and the short verifier
+struct ExecutionPath {
+    static constexpr int kTiers = std::max(int(SimdTier::Count), int(JitMode::WideLoad) + 1);
+
+    Engine engine;
+    int tier;
+
+    std::string name() const {
+        if (engine == Engine::JIT) {
+            return std::string("JIT/") + (JitMode(tier) == JitMode::WideLoad ? "wide-load" : "per-byte");
+        }
+        return std::string(engineName(engine)) + "/" + tierName(SimdTier(tier));
+    }
+};
+
+// Opt-in cost accounting for one pattern.  Calls, bytes and engine choices are counted
+// exactly; only one call in kSampleEvery is timed, and totals are scaled up from those,
+// so the clock stays off the hot path.  Sampled latencies go into log-linear (HDR-style)
+// buckets: kSubBuckets per power of two.
+struct PatternStats {
+    static constexpr uint64_t kSampleEvery = 64;
+    static constexpr int kSubBits = 2;
+    static constexpr int kSubBuckets = 1 << kSubBits;
+    static constexpr int kBuckets = 64 * kSubBuckets;
+
+    bool shouldSample() {
+        return m_calls.fetch_add(1, std::memory_order_relaxed) % kSampleEvery == 0;
+    }
+
+    void record(ExecutionPath path, size_t bytes) {
+        m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        m_pathCalls[int(path.engine)][path.tier].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void recordSample(uint64_t ns) {
+        m_sampledCalls.fetch_add(1, std::memory_order_relaxed);
+        m_sampledNs.fetch_add(ns, std::memory_order_relaxed);
+        m_histogram[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t calls() const {
+        return m_calls.load(std::memory_order_relaxed);
+    }
+
+    uint64_t bytes() const {
+        return m_bytes.load(std::memory_order_relaxed);
+    }
+
+    uint64_t engineCalls(Engine engine) const {
+        uint64_t n = 0;
+        for (int tier = 0; tier < ExecutionPath::kTiers; ++tier) {
+            n += pathCalls({engine, tier});
+        }
+        return n;
+    }
+
+    uint64_t pathCalls(ExecutionPath path) const {
+        return m_pathCalls[int(path.engine)][path.tier].load(std::memory_order_relaxed);
+    }
+
+    // total time spent matching, extrapolated from the samples
+    uint64_t estimatedNs() const {
+        auto sampled = m_sampledCalls.load(std::memory_order_relaxed);
+        if (!sampled) {
+            return 0;
+        }
+        // the product outgrows 64 bits long before the estimate does
+        unsigned __int128 total = (unsigned __int128)m_sampledNs.load(std::memory_order_relaxed) * calls() / sampled;
+        return total > UINT64_MAX ? UINT64_MAX : uint64_t(total);
+    }
+
+    // lower bound of the bucket holding the q-quantile of sampled latencies
+    uint64_t quantileNs(double q) const {
+        uint64_t total = m_sampledCalls.load(std::memory_order_relaxed);
+        uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            seen += m_histogram[b].load(std::memory_order_relaxed);
+            if (total && seen >= q * total) {
+                return bucketFloor(b);
+            }
+        }
+        return 0;
+    }
+
+    static int bucket(uint64_t ns) {
+        if (ns < kSubBuckets) {
+            return ns;
+        }
+        int exponent = 63 - __builtin_clzll(ns);
+        int sub = (ns >> (exponent - kSubBits)) & (kSubBuckets - 1);
+        return (exponent - kSubBits + 1) * kSubBuckets + sub;
+    }
+
+    static uint64_t bucketFloor(int b) {
+        if (b < kSubBuckets) {
+            return b;
+        }
+        int exponent = b / kSubBuckets + kSubBits - 1;
+        return (uint64_t(kSubBuckets) | (b % kSubBuckets)) << (exponent - kSubBits);
+    }
+
+private:
+    std::atomic<uint64_t> m_calls{0};
+    std::atomic<uint64_t> m_bytes{0};
+    std::atomic<uint64_t> m_sampledCalls{0};
+    std::atomic<uint64_t> m_sampledNs{0};
+    std::atomic<uint64_t> m_pathCalls[int(Engine::Count)][ExecutionPath::kTiers] = {};
+    std::atomic<uint64_t> m_histogram[kBuckets] = {};
+};
+
+// One row of StatsRegistry::top()
+struct PatternCost {
+    std::string name;
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t estimatedNs;
+    uint64_t p50Ns;
+    uint64_t p99Ns;
+    Engine engine; // the engine most calls used
+    ExecutionPath path; // and the path most calls used
+
+    void print(std::ostream& out) const {
+        out << name << ": " << calls << " calls, " << bytes << " bytes, ~" << estimatedNs / 1000 << "us"
+            << " (p50 " << p50Ns << "ns, p99 " << p99Ns << "ns) via " << path.name() << std::endl;
+    }
+};
+
+// Process-wide home of PatternStats, keyed by pattern name
+struct StatsRegistry {
+    PatternStats& stats(std::string const& name) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& stats = m_stats[name];
+        if (!stats) {
+            stats = std::make_unique<PatternStats>();
+        }
+        return *stats;
+    }
+
+    // the n patterns with the most estimated matching time, most expensive first
+    std::vector<PatternCost> top(size_t n) const {
+        std::vector<PatternCost> rows;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto& [name, stats] : m_stats) {
+                auto engine = Engine::NFA;
+                ExecutionPath path = {Engine::NFA, 0};
+                for (int e = 0; e < int(Engine::Count); ++e) {
+                    if (stats->engineCalls(Engine(e)) > stats->engineCalls(engine)) {
+                        engine = Engine(e);
+                    }
+                    for (int tier = 0; tier < ExecutionPath::kTiers; ++tier) {
+                        if (stats->pathCalls({Engine(e), tier}) > stats->pathCalls(path)) {
+                            path = {Engine(e), tier};
+                        }
+                    }
+                }
+                rows.push_back({name, stats->calls(), stats->bytes(), stats->estimatedNs(),
+                    stats->quantileNs(0.5), stats->quantileNs(0.99), engine, path});
+            }
+        }
+        std::sort(rows.begin(), rows.end(), [](auto const& a, auto const& b) {
+            return a.estimatedNs > b.estimatedNs;
+        });
+        rows.resize(std::min(n, rows.size()));
+        return rows;
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::map<std::string, std::unique_ptr<PatternStats>> m_stats;
+};
+
+// One pattern's engine configuration, as picked by Autotuner
+struct TuningChoice {
+    Engine engine = Engine::DFA;
+    JitMode jitMode = JitMode::PerByte;
+    bool filter = true;   // FeasibilityFilter in front of the engine
+    double nsPerByte = 0; // as measured when it was picked
+};
+
+// Autotuner's choices for one host, by pattern toStr().  Saved as text: a header naming the
+// host, then a line per pattern.  A profile written on another host doesn't load, since its
+// timings say nothing about this one.
+struct TuningProfile {
+    std::string host = currentHost();
+    std::map<std::string, TuningChoice> choices;
+
+    std::optional<TuningChoice> find(std::string const& pattern) const {
+        auto it = choices.find(pattern);
+        if (it == choices.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    // written beside path and renamed over it, so readers never see half a profile
+    void save(std::string const& path) const {
+        {
+            std::ofstream out(path + ".tmp");
+            out << "tuning-profile 1 " << std::quoted(host) << std::endl;
+            for (auto& [pattern, choice] : choices) {
+                out << engineName(choice.engine) << " " << int(choice.jitMode) << " " << choice.filter << " "
+                    << choice.nsPerByte << " " << std::quoted(pattern) << std::endl;
+            }
+        }
+        std::rename((path + ".tmp").c_str(), path.c_str());
+    }
+
+    static std::optional<TuningProfile> load(std::string const& path) {
+        std::ifstream in(path);
+        std::string magic;
+        int version = 0;
+        TuningProfile profile;
+        if (!(in >> magic >> version >> std::quoted(profile.host)) || magic != "tuning-profile" || version != 1
+            || profile.host != currentHost()) {
+            return std::nullopt;
+        }
+
+        std::string engine, pattern;
+        int jitMode;
+        TuningChoice choice;
+        while (in >> engine >> jitMode >> choice.filter >> choice.nsPerByte >> std::quoted(pattern)) {
+            choice.engine = Engine::Count;
+            for (int e = 0; e < int(Engine::Count); ++e) {
+                if (engine == engineName(Engine(e))) {
+                    choice.engine = Engine(e);
+                }
+            }
+            if (choice.engine == Engine::Count) {
+                return std::nullopt;
+            }
+            // a mode this build doesn't know: drop the entry, the pattern gets the defaults
+            if (jitMode < int(JitMode::PerByte) || jitMode > int(JitMode::WideLoad)) {
+                continue;
+            }
+            choice.jitMode = JitMode(jitMode);
+            profile.choices[pattern] = choice;
+        }
+        return profile;
+    }
+
+    // the host name plus the SIMD tier in use
+    static std::string currentHost() {
+        char name[256] = {};
+        gethostname(name, sizeof(name) - 1);
+        return std::string(name) + "/" + tierName(detectTier());
+    }
+};
+
+// Front door for matching one pattern: owns everything compiled for it and picks an
+// engine per call.
+struct Matcher {
+    explicit Matcher(NFA nfa, std::optional<TuningChoice> tuning = std::nullopt)
+        : m_nfa(reduce(std::move(nfa))), m_dfa(m_nfa.lower().freeze()) {
+        if (tuning) {
+            setEngine(tuning->engine, tuning->jitMode);
+            setFilter(tuning->filter);
+        }
+    }
+
+    template <typename Parser>
+    static Matcher compile(Parser const& parser) {
+        return Matcher(toNFA(parser));
+    }
+
+    // configured as the profile says for this pattern, if it has it
+    template <typename Parser>
+    static Matcher compile(Parser const& parser, TuningProfile const& profile) {
+        return Matcher(toNFA(parser), profile.find(parser.toStr()));
+    }
+
+    template <typename Parser>
+    static NFA toNFA(Parser const& parser) {
+        TraceScope trace("toNFA");
+        return parser.toNFA();
+    }
+
+    // The NFA every engine is built from: NFA::reduce() of it, unless it has capture tags,
+    // which reduction drops and BitState needs.
+    static NFA reduce(NFA nfa) {
+        if (!nfa.m_tags.empty()) {
+            return nfa;
+        }
+        return nfa.reduce();
+    }
+
+    Matcher(Matcher const&) = delete;
+    Matcher& operator=(Matcher const&) = delete;
+
+    bool operator()(std::string_view const sv) const {
+        if (!m_stats) {
+            return run(sv, engineFor(sv.size()));
+        }
+
+        auto path = pathFor(sv.size());
+        m_stats->record(path, sv.size());
+        if (!m_stats->shouldSample()) {
+            return run(sv, path.engine);
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool matched = run(sv, path.engine);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        m_stats->recordSample(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        return matched;
+    }
+
+    // Engine for operator(); JIT compiles the DFA on first use (or of a new mode)
+    void setEngine(Engine engine, JitMode jitMode = JitMode::PerByte) {
+        if (engine == Engine::JIT && (!m_jit || m_jitMode != jitMode)) {
+            m_jit = std::make_unique<JitFunction>(m_nfa.lower(), jitMode);
+            m_jitMode = jitMode;
+        }
+        m_engine = engine;
+    }
+
+    Engine engine() const {
+        return m_engine;
+    }
+
+    // Engine operator() runs on an input of `length` bytes.  The NFA engine hands inputs
+    // whose BitState bitmap fits on the stack to BitState, which skips the set-up of the
+    // NFA simulation, and BitState hands inputs too long for any bitmap to the DFA.  The
+    // DFA engine runs the short verifier instead when the pattern has one.
+    Engine engineFor(size_t length) const {
+        auto engine = m_engine;
+        if (engine == Engine::NFA && BitState::fitsOnStack(m_nfa.numStates(), length)) {
+            return Engine::BitState;
+        }
+        if (engine == Engine::BitState && !BitState::fits(m_nfa.numStates(), length)) {
+            engine = Engine::DFA;
+        }
+        if (engine == Engine::DFA || engine == Engine::ShortVerifier) {
+            return m_short ? Engine::ShortVerifier : Engine::DFA;
+        }
+        return engine;
+    }
+
+    // engineFor() plus the tier it runs at
+    ExecutionPath pathFor(size_t length) const {
+        auto engine = engineFor(length);
+        return {engine, engine == Engine::JIT ? int(m_jitMode) : int(kernels().tier)};
+    }
+
+    // Whether operator() runs FeasibilityFilter first; on by default
+    void setFilter(bool filter) {
+        m_filter = filter;
+    }
+
+    // Account calls to operator() under `name` in the registry
+    void enableStats(StatsRegistry& registry, std::string const& name) {
+        m_stats = &registry.stats(name);
+    }
+
+    // Capture positions (see BitState::match), or nullopt if sv doesn't match.  BitState is
+    // the only capturing engine; past BitState::kStackBits its bitmap moves to the heap, and
+    // past BitState::fits() the DFA decides and a match comes back without positions.
+    std::optional<std::vector<int>> captures(std::string_view const sv) const {
+        if (!BitState::fits(m_nfa.numStates(), sv.size())) {
+            return m_dfa.testMatch(sv) ? std::optional(std::vector<int>()) : std::nullopt;
+        }
+        std::vector<int> caps;
+        if (!m_bitState.match(sv, &caps)) {
+            return std::nullopt;
+        }
+        return caps;
+    }
+
+    MemoryUsage memoryUsage() const {
+        auto usage = m_nfa.memoryUsage();
+        usage += m_dfa.memoryUsage();
+        usage += m_feasible.memoryUsage();
+        if (m_short) {
+            usage += m_short->memoryUsage();
+        }
+        if (m_jit) {
+            usage += m_jit->memoryUsage();
+        }
+        return usage;
+    }
+
+    NFA const& nfa() const {
+        return m_nfa;
+    }
+
+    FrozenDFA const& dfa() const {
+        return m_dfa;
+    }
+
+private:
+    // engine is engineFor(sv.size())
+    bool run(std::string_view const sv, Engine engine) const {
+        if (m_filter && !m_feasible(sv)) {
+            return false;
+        }
+        switch (engine) {
+        case Engine::NFA:
+            return m_nfa.testMatch(sv);
+        case Engine::JIT:
+            return (*m_jit)(sv);
+        case Engine::BitState:
+            return m_bitState.match(sv);
+        case Engine::ShortVerifier:
+            return m_short->match(sv);
+        default:
+            return m_dfa.testMatch(sv);
+        }
+    }
+
+    NFA m_nfa;
+    FrozenDFA m_dfa;
+    FeasibilityFilter m_feasible{m_dfa};
+    std::optional<ShortVerifier> m_short = ShortVerifier::compile(m_dfa); // replaces the DFA when it compiles
+    BitState m_bitState{m_nfa};
+    std::unique_ptr<JitFunction> m_jit;
+    JitMode m_jitMode = JitMode::PerByte;
+    Engine m_engine = Engine::DFA;
+    bool m_filter = true;
+    PatternStats* m_stats = nullptr;
+};
+
+// Compiled matchers shared across threads, keyed by the pattern's toStr() and engine.
+// Concurrent requests for a pattern that is still compiling wait on that one compile
+// (single flight).  Finished entries are evicted least recently used first once their
+// memoryUsage() exceeds the budget; callers' shared_ptrs keep evicted matchers alive.
+struct CompileCache {
+    struct Stats {
+        size_t hits = 0;      // found compiled
+        size_t waits = 0;     // found compiling, waited for it
+        size_t misses = 0;    // compiled here
+        size_t evictions = 0;
+    };
+
+    explicit CompileCache(size_t budget = 64 << 20) : m_budget(budget) {}
+
+    CompileCache(CompileCache const&) = delete;
+    CompileCache& operator=(CompileCache const&) = delete;
+
+    // The cache for the whole process
+    static CompileCache& global() {
+        static CompileCache cache;
+        return cache;
+    }
+
+    template <typename Parser>
+    std::shared_ptr<Matcher const> get(Parser const& parser, Engine engine = Engine::DFA) {
+        auto key = parser.toStr() + '\0' + engineName(engine);
+
+        std::unique_lock lock(m_mutex);
+        if (auto it = m_entries.find(key); it != m_entries.end()) {
+            auto result = it->second.result;
+            if (it->second.bytes) {
+                m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+                ++m_stats.hits;
+            } else {
+                ++m_stats.waits;
+            }
+            lock.unlock();
+            return result.get();
+        }
+
+        std::promise<std::shared_ptr<Matcher const>> promise;
+        m_entries[key].result = promise.get_future().share();
+        ++m_stats.misses;
+        lock.unlock();
+
+        std::shared_ptr<Matcher> matcher;
+        try {
+            TraceScope trace("compileCache.compile");
+            matcher = std::make_shared<Matcher>(Matcher::toNFA(parser));
+            matcher->setEngine(engine);
+        } catch (...) {
+            // waiters see the failure; the next request tries again
+            promise.set_exception(std::current_exception());
+            lock.lock();
+            m_entries.erase(key);
+            throw;
+        }
+        promise.set_value(matcher);
+
+        lock.lock();
+        auto& entry = m_entries.at(key);
+        entry.bytes = matcher->memoryUsage().total();
+        m_lru.push_front(key);
+        entry.lru = m_lru.begin();
+        m_bytes += entry.bytes;
+        // keep the newest entry even if it alone is over budget
+        while (m_bytes > m_budget && m_lru.size() > 1) {
+            auto victim = m_entries.find(m_lru.back());
+            m_bytes -= victim->second.bytes;
+            m_entries.erase(victim);
+            m_lru.pop_back();
+            ++m_stats.evictions;
+        }
+        return matcher;
+    }
+
+    size_t bytes() const {
+        std::lock_guard lock(m_mutex);
+        return m_bytes;
+    }
+
+    // entries, including ones still compiling
+    size_t size() const {
+        std::lock_guard lock(m_mutex);
+        return m_entries.size();
+    }
+
+    Stats stats() const {
+        std::lock_guard lock(m_mutex);
+        return m_stats;
+    }
+
+private:
+    struct Entry {
+        std::shared_future<std::shared_ptr<Matcher const>> result;
+        size_t bytes = 0; // 0 while compiling, when the entry isn't in m_lru yet
+        std::list<std::string>::iterator lru;
+    };
+
+    size_t m_budget;
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, Entry> m_entries;
+    std::list<std::string> m_lru; // most recently used first
+    size_t m_bytes = 0;
+    Stats m_stats;
+};
+
+// Compiles a pattern library on a pool of threads, e.g. at startup.  Patterns are taken
+// longest source first, so the expensive ones don't start last and leave the other
+// threads idle at the end.  A pattern only starts while the estimated memory of the
+// compiles in flight stays within the budget (one always runs); the estimate is its
+// source length times the bytes per source character seen so far.  Failures don't stop
+// the others: each result carries either a matcher or the error.
+struct BulkCompiler {
+    struct Options {
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        size_t memoryBudget = 256 << 20;
+        Engine engine = Engine::DFA;
+    };
+
+    struct Result {
+        std::string name;
+        std::unique_ptr<Matcher> matcher; // null if compiling failed
+        std::string error;
+        std::chrono::nanoseconds toNFA{0};
+        std::chrono::nanoseconds compile{0}; // lower() through the engine's tables
+        std::chrono::nanoseconds jit{0};     // setEngine(), which only has work to do for JIT
+        size_t bytes = 0;
+    };
+
+    explicit BulkCompiler(Options options) : m_options(options) {}
+
+    template <typename Parser>
+    void add(Parser const& parser) {
+        add(parser.toStr(), [parser]() {
+            return Matcher::toNFA(parser);
+        });
+    }
+
+    // for patterns built at runtime; toNFA may throw
+    void add(std::string name, std::function<NFA()> toNFA) {
+        m_patterns.push_back({std::move(name), std::move(toNFA)});
+    }
+
+    // One result per pattern, in the order they were added
+    std::vector<Result> compile() {
+        TraceScope trace("bulkCompile");
+        std::vector<Result> results(m_patterns.size());
+        std::vector<size_t> order(m_patterns.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return m_patterns[a].name.size() > m_patterns[b].name.size();
+        });
+
+        m_next = 0;
+        m_inFlight = 0;
+        m_peakInFlight = 0;
+        m_bytes = 0;
+        m_chars = 0;
+        std::vector<std::thread> threads;
+        // threads == 0 still gets one
+        for (size_t t = 0; t < std::min(std::max<size_t>(m_options.threads, 1), order.size()); ++t) {
+            threads.emplace_back([&] {
+                work(order, results);
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return results;
+    }
+
+    // Highest estimated memory of the compiles in flight during the last compile()
+    size_t peakInFlight() const {
+        return m_peakInFlight;
+    }
+
+private:
+    struct Pattern {
+        std::string name;
+        std::function<NFA()> toNFA;
+    };
+
+    static constexpr size_t kInitialBytesPerChar = 4096;
+
+    void work(std::vector<size_t> const& order, std::vector<Result>& results) {
+        std::unique_lock lock(m_mutex);
+        while (m_next < order.size()) {
+            auto& pattern = m_patterns[order[m_next]];
+            size_t estimate = pattern.name.size() * (m_chars ? std::max<size_t>(1, m_bytes / m_chars) : kInitialBytesPerChar);
+            if (m_inFlight && m_inFlight + estimate > m_options.memoryBudget) {
+                m_finished.wait(lock);
+                continue;
+            }
+            auto& result = results[order[m_next++]];
+            m_inFlight += estimate;
+            m_peakInFlight = std::max(m_peakInFlight, m_inFlight);
+            lock.unlock();
+
+            compileOne(pattern, result);
+
+            lock.lock();
+            m_inFlight -= estimate;
+            if (result.matcher) {
+                m_bytes += result.bytes;
+                m_chars += pattern.name.size();
+            }
+            m_finished.notify_all();
+        }
+    }
+
+    void compileOne(Pattern const& pattern, Result& result) const {
+        TraceScope trace("bulkCompile.pattern");
+        result.name = pattern.name;
+        try {
+            auto start = std::chrono::steady_clock::now();
+            auto nfa = pattern.toNFA();
+            auto built = std::chrono::steady_clock::now();
+            result.toNFA = built - start;
+            result.matcher = std::make_unique<Matcher>(std::move(nfa));
+            auto compiled = std::chrono::steady_clock::now();
+            result.compile = compiled - built;
+            if (m_options.engine != Engine::DFA) {
+                result.matcher->setEngine(m_options.engine);
+                result.jit = std::chrono::steady_clock::now() - compiled;
+            }
+            result.bytes = result.matcher->memoryUsage().total();
+        } catch (std::exception const& e) {
+            result.matcher.reset();
+            result.error = e.what();
+        } catch (...) {
+            result.matcher.reset();
+            result.error = "unknown error";
+        }
+    }
+
+    Options m_options;
+    std::vector<Pattern> m_patterns;
+    std::mutex m_mutex;
+    std::condition_variable m_finished;
+    size_t m_next = 0;          // into the longest-first order
+    size_t m_inFlight = 0;      // estimated bytes being compiled
+    size_t m_peakInFlight = 0;
+    size_t m_bytes = 0;         // compiled so far, and the source characters they came from
+    size_t m_chars = 0;
+};
+
+// Times every engine configuration of each pattern over a sample corpus on this machine and
+// keeps the fastest in a TuningProfile.  start() re-tunes on a background thread whenever
+// setCorpus() changes the corpus, saving each new profile for Matcher::compile to load.
+struct Autotuner {
+    explicit Autotuner(std::vector<std::string> corpus, int rounds = 3) : m_corpus(std::move(corpus)), m_rounds(rounds) {}
+
+    Autotuner(Autotuner const&) = delete;
+    Autotuner& operator=(Autotuner const&) = delete;
+
+    ~Autotuner() {
+        stop();
+    }
+
+    // add patterns before start()
+    template <typename Parser>
+    void add(Parser const& parser) {
+        m_patterns.push_back({parser.toStr(), parser.toNFA()});
+    }
+
+    static std::vector<TuningChoice> candidates() {
+        std::vector<TuningChoice> all;
+        for (bool filter : {true, false}) {
+            all.push_back({Engine::NFA, JitMode::PerByte, filter});
+            all.push_back({Engine::DFA, JitMode::PerByte, filter});
+            all.push_back({Engine::JIT, JitMode::PerByte, filter});
+            all.push_back({Engine::JIT, JitMode::WideLoad, filter});
+            all.push_back({Engine::BitState, JitMode::PerByte, filter});
+        }
+        return all;
+    }
+
+    TuningProfile tune() const {
+        std::unique_lock lock(m_mutex);
+        auto corpus = m_corpus;
+        lock.unlock();
+        return tune(corpus);
+    }
+
+    void setCorpus(std::vector<std::string> corpus) {
+        std::lock_guard lock(m_mutex);
+        m_corpus = std::move(corpus);
+        ++m_generation;
+        m_changed.notify_all();
+    }
+
+    // Tune now and after every setCorpus(), saving each profile to path
+    void start(std::string const& path) {
+        assert(!m_thread.joinable());
+        m_thread = std::thread([this, path] {
+            std::unique_lock lock(m_mutex);
+            while (!m_stopping) {
+                if (m_tunedGeneration == m_generation) {
+                    m_changed.wait(lock);
+                    continue;
+                }
+                auto generation = m_generation;
+                auto corpus = m_corpus;
+                lock.unlock();
+                auto profile = std::make_shared<TuningProfile const>(tune(corpus));
+                profile->save(path);
+                lock.lock();
+                m_profile = std::move(profile);
+                m_tunedGeneration = generation;
+                m_changed.notify_all();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stopping = true;
+            m_changed.notify_all();
+        }
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    // Wait for the background thread to catch up with the current corpus
+    std::shared_ptr<TuningProfile const> sync() const {
+        std::unique_lock lock(m_mutex);
+        m_changed.wait(lock, [&] {
+            return m_tunedGeneration == m_generation || m_stopping;
+        });
+        return m_profile;
+    }
+
+private:
+    struct Pattern {
+        std::string name;
+        NFA nfa;
+    };
+
+    TuningProfile tune(std::vector<std::string> const& corpus) const {
+        TraceScope trace("autotune", "tune");
+        size_t bytes = 1;
+        for (auto& sample : corpus) {
+            bytes += sample.size();
+        }
+
+        TuningProfile profile;
+        for (auto& pattern : m_patterns) {
+            Matcher matcher(pattern.nfa);
+            std::optional<size_t> expected;
+            for (auto candidate : candidates()) {
+                matcher.setEngine(candidate.engine, candidate.jitMode);
+                matcher.setFilter(candidate.filter);
+                // best of m_rounds, so one preempted round doesn't decide
+                double best = std::numeric_limits<double>::max();
+                for (int round = 0; round < m_rounds; ++round) {
+                    size_t matches = 0;
+                    auto start = std::chrono::steady_clock::now();
+                    for (auto& sample : corpus) {
+                        matches += matcher(sample);
+                    }
+                    auto elapsed = std::chrono::steady_clock::now() - start;
+                    best = std::min(best, std::chrono::duration<double, std::nano>(elapsed).count());
+                    assert(matches == expected.value_or(matches) && "engines disagree");
+                    expected = matches;
+                }
+                candidate.nsPerByte = best / bytes;
+                auto [it, inserted] = profile.choices.insert({pattern.name, candidate});
+                if (!inserted && candidate.nsPerByte < it->second.nsPerByte) {
+                    it->second = candidate;
+                }
+            }
+        }
+        return profile;
+    }
+
+    std::vector<Pattern> m_patterns;
+    std::vector<std::string> m_corpus;
+    int m_rounds;
+
+    mutable std::mutex m_mutex;
+    mutable std::condition_variable m_changed;
+    std::thread m_thread;
+    uint64_t m_generation = 1;
+    uint64_t m_tunedGeneration = 0;
+    bool m_stopping = false;
+    std::shared_ptr<TuningProfile const> m_profile;
+};
+
+// Boolean filter over patterns, such as (p1 && !p2) || p3.  Build it from leaves and the
+// usual operators, then evaluate it through a PredicatePlanner.
+struct Predicate {
+    enum class Op { Leaf, Not, And, Or };
+
+    Op op;
+    Matcher const* matcher = nullptr;
+    std::vector<Predicate> children;
+    int leafId = -1; // assigned by PredicatePlanner
+
+    static Predicate leaf(Matcher const& matcher) {
+        return {Op::Leaf, &matcher, {}};
+    }
+
+    friend Predicate operator!(Predicate p) {
+        return {Op::Not, nullptr, {std::move(p)}};
+    }
+
+    friend Predicate operator&&(Predicate a, Predicate b) {
+        return join(Op::And, std::move(a), std::move(b));
+    }
+
+    friend Predicate operator||(Predicate a, Predicate b) {
+        return join(Op::Or, std::move(a), std::move(b));
+    }
+
+private:
+    // flatten a && (b && c) into one node so the planner can order all three
+    static Predicate join(Op op, Predicate a, Predicate b) {
+        Predicate p{op, nullptr, {}};
+        for (auto* side : {&a, &b}) {
+            if (side->op == op) {
+                for (auto& child : side->children) {
+                    p.children.push_back(std::move(child));
+                }
+            } else {
+                p.children.push_back(std::move(*side));
+            }
+        }
+        return p;
+    }
+};
+
+// Evaluates a Predicate per record, ordering And/Or children so the cheapest and most
+// decisive run first: And children by cost / P(false), Or children by cost / P(true),
+// which minimises expected cost for independent children.  A leaf's cost is its pattern's
+// estimated per-byte cost (engine and state count) times the mean record length;
+// selectivities are sampled from live records, one in kSampleEvery of which evaluates
+// every leaf so the estimates aren't skewed by short-circuiting.  Every replanEvery
+// records (never for 0; call replan() directly) the children are re-sorted and the
+// samples decayed, following traffic drift.
+struct PredicatePlanner {
+    static constexpr uint64_t kSampleEvery = 16;
+
+    explicit PredicatePlanner(Predicate predicate, uint64_t replanEvery = 4096)
+        : m_root(std::move(predicate)), m_replanEvery(replanEvery) {
+        collectLeaves(m_root);
+        replan();
+    }
+
+    bool operator()(std::string_view const record) {
+        bool sample = m_records++ % kSampleEvery == 0;
+        if (sample) {
+            m_sampledBytes += record.size();
+            ++m_sampledRecords;
+        }
+        bool result = eval(m_root, record, sample);
+        if (m_replanEvery && m_records % m_replanEvery == 0) {
+            replan();
+        }
+        return result;
+    }
+
+    void replan() {
+        TraceScope trace("planner.replan", "match");
+        plan(m_root);
+        // halve the history so recent traffic dominates
+        for (auto& leaf : m_leaves) {
+            leaf.sampled /= 2;
+            leaf.matched /= 2;
+        }
+        m_sampledBytes /= 2;
+        m_sampledRecords /= 2;
+    }
+
+    // how many times the pattern behind `matcher` has run
+    uint64_t evaluations(Matcher const& matcher) const {
+        uint64_t count = 0;
+        for (auto& leaf : m_leaves) {
+            count += leaf.matcher == &matcher ? leaf.evaluations : 0;
+        }
+        return count;
+    }
+
+    // the current plan, e.g. "(L1 && !L0)"
+    std::string explain() const {
+        return explain(m_root);
+    }
+
+private:
+    struct Leaf {
+        Matcher const* matcher;
+        double perByte;
+        uint64_t sampled = 0;
+        uint64_t matched = 0;
+        uint64_t evaluations = 0;
+    };
+
+    struct Estimate {
+        double cost;
+        double probability;
+    };
+
+    // relative cost of one byte on each engine, per state for the NFA-based ones
+    static double perByteCost(Matcher const& matcher) {
+        switch (matcher.engine()) {
+        case Engine::NFA:
+            return 4.0 * matcher.nfa().numStates();
+        case Engine::BitState:
+            return 1.0 * matcher.nfa().numStates();
+        case Engine::JIT:
+            return 0.5;
+        default:
+            return 1.0;
+        }
+    }
+
+    void collectLeaves(Predicate& p) {
+        if (p.op == Predicate::Op::Leaf) {
+            p.leafId = m_leaves.size();
+            m_leaves.push_back({p.matcher, perByteCost(*p.matcher)});
+        }
+        for (auto& child : p.children) {
+            collectLeaves(child);
+        }
+    }
+
+    bool eval(Predicate const& p, std::string_view const record, bool sample) {
+        switch (p.op) {
+        case Predicate::Op::Leaf: {
+            auto& leaf = m_leaves[p.leafId];
+            ++leaf.evaluations;
+            bool matched = (*leaf.matcher)(record);
+            if (sample) {
+                ++leaf.sampled;
+                leaf.matched += matched;
+            }
+            return matched;
+        }
+        case Predicate::Op::Not:
+            return !eval(p.children.front(), record, sample);
+        default: {
+            // a sampled record runs every child; the first decisive one still sets the result
+            bool decisive = p.op == Predicate::Op::Or;
+            bool result = !decisive;
+            for (auto& child : p.children) {
+                if (eval(child, record, sample) == decisive) {
+                    result = decisive;
+                    if (!sample) {
+                        break;
+                    }
+                }
+            }
+            return result;
+        }
+        }
+    }
+
+    Estimate plan(Predicate& p) {
+        switch (p.op) {
+        case Predicate::Op::Leaf: {
+            auto& leaf = m_leaves[p.leafId];
+            double meanBytes = m_sampledRecords ? double(m_sampledBytes) / m_sampledRecords : 1;
+            // add-one smoothing keeps unsampled leaves at 1/2
+            double probability = (leaf.matched + 1.0) / (leaf.sampled + 2.0);
+            return {leaf.perByte * std::max(meanBytes, 1.0), probability};
+        }
+        case Predicate::Op::Not: {
+            auto e = plan(p.children.front());
+            return {e.cost, 1 - e.probability};
+        }
+        default: {
+            bool isAnd = p.op == Predicate::Op::And;
+            std::vector<std::pair<Estimate, Predicate>> ranked;
+            for (auto& child : p.children) {
+                ranked.push_back({plan(child), std::move(child)});
+            }
+            // the chance a child settles the result: false for And, true for Or
+            auto decides = [&](Estimate e) {
+                return std::max(isAnd ? 1 - e.probability : e.probability, 1e-9);
+            };
+            std::stable_sort(ranked.begin(), ranked.end(), [&](auto const& a, auto const& b) {
+                return a.first.cost / decides(a.first) < b.first.cost / decides(b.first);
+            });
+
+            Estimate total = {0, 1};
+            double reach = 1;
+            p.children.clear();
+            for (auto& [e, child] : ranked) {
+                total.cost += reach * e.cost;
+                reach *= 1 - decides(e);
+                total.probability *= isAnd ? e.probability : 1 - e.probability;
+                p.children.push_back(std::move(child));
+            }
+            if (!isAnd) {
+                total.probability = 1 - total.probability;
+            }
+            return total;
+        }
+        }
+    }
+
+    std::string explain(Predicate const& p) const {
+        switch (p.op) {
+        case Predicate::Op::Leaf:
+            return "L" + std::to_string(p.leafId);
+        case Predicate::Op::Not:
+            return "!" + explain(p.children.front());
+        default: {
+            std::string out;
+            for (auto& child : p.children) {
+                out += (out.empty() ? "(" : p.op == Predicate::Op::And ? " && " : " || ") + explain(child);
+            }
+            return out + ")";
+        }
+        }
+    }
+
+    Predicate m_root;
+    uint64_t m_replanEvery;
+    std::vector<Leaf> m_leaves;
+    uint64_t m_records = 0;
+    uint64_t m_sampledBytes = 0;
+    uint64_t m_sampledRecords = 0;
+};
+
+// Trigram postings over a fixed list of documents (records or blocks of a corpus), so
+// repeated queries only run the automaton over documents that can possibly match.
+struct TrigramIndex {
+    using DocId = uint32_t;
+
+    explicit TrigramIndex(std::vector<std::string> docs) : m_docs(std::move(docs)) {
+        for (DocId doc = 0; doc < m_docs.size(); ++doc) {
+            auto& text = m_docs[doc];
+            std::vector<uint32_t> keys;
+            for (size_t i = 0; i + 3 <= text.size(); ++i) {
+                keys.push_back(key(text.substr(i, 3)));
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            for (auto k : keys) {
+                m_postings[k].push_back(doc);
+            }
+        }
+    }
+
+    // Sorted ids of documents that satisfy the query
+    std::vector<DocId> candidates(TrigramQuery const& query) const {
+        TraceScope trace("trigram.candidates", "match");
+        auto docs = eval(query);
+        if (docs) {
+            return *docs;
+        }
+        std::vector<DocId> everything(m_docs.size());
+        for (DocId doc = 0; doc < m_docs.size(); ++doc) {
+            everything[doc] = doc;
+        }
+        return everything;
+    }
+
+    // Candidates that `verify` (e.g. a DFA's testMatch) accepts
+    template <typename Verify>
+    std::vector<DocId> search(TrigramQuery const& query, Verify verify) const {
+        auto docs = candidates(query);
+        TraceScope trace("trigram.verify", "match");
+        std::vector<DocId> found;
+        for (auto doc : docs) {
+            if (verify(m_docs[doc])) {
+                found.push_back(doc);
+            }
+        }
+        return found;
+    }
+
+    std::vector<std::string> const& docs() const {
+        return m_docs;
+    }
+
+private:
+    static uint32_t key(std::string const& trigram) {
+        return uint32_t((unsigned char)trigram[0]) << 16 | uint32_t((unsigned char)trigram[1]) << 8 | (unsigned char)trigram[2];
+    }
+
+    // nullopt stands for every document
+    std::optional<std::vector<DocId>> eval(TrigramQuery const& query) const {
+        using Op = TrigramQuery::Op;
+        switch (query.op) {
+        case Op::All:
+            return std::nullopt;
+        case Op::None:
+            return std::vector<DocId>();
+        default:
+            break;
+        }
+
+        // fold the children together; every-document is the identity of And and absorbs Or
+        bool isAnd = query.op == Op::And;
+        std::optional<std::vector<DocId>> result;
+        bool first = true;
+        auto add = [&](std::optional<std::vector<DocId>> docs) {
+            if (first) {
+                first = false;
+                result = std::move(docs);
+            } else if (!result || !docs) {
+                if (!isAnd) {
+                    result = std::nullopt;
+                } else if (!result) {
+                    result = std::move(docs);
+                }
+            } else {
+                std::vector<DocId> out;
+                if (isAnd) {
+                    std::set_intersection(result->begin(), result->end(), docs->begin(), docs->end(), std::back_inserter(out));
+                } else {
+                    std::set_union(result->begin(), result->end(), docs->begin(), docs->end(), std::back_inserter(out));
+                }
+                result = std::move(out);
+            }
+        };
+
+        for (auto& trigram : query.trigrams) {
+            auto it = m_postings.find(key(trigram));
+            add(it == m_postings.end() ? std::vector<DocId>() : it->second);
+        }
+        for (auto& sub : query.subs) {
+            add(eval(sub));
+        }
+        return result;
+    }
+
+    std::vector<std::string> m_docs;
+    std::unordered_map<uint32_t, std::vector<DocId>> m_postings;
+};
+
+// Full-match dispatch over a large set of patterns, each with its own DFA, for when their
+// union DFA is too big to build.  For every pattern the index records which first bytes
+// and which input lengths it can possibly accept, as one bitmap over the patterns per
+// byte and per length; an input only goes to the patterns in the intersection of its
+// first byte's and its length's bitmaps.  Lengths from kMaxLength on share a bitmap.
+struct DispatchIndex {
+    using PatternId = uint32_t;
+    static constexpr size_t kMaxLength = 64;
+
+    // fas are DFAs or FrozenDFAs; pattern i is fas[i]
+    template <typename FA>
+    explicit DispatchIndex(std::vector<FA> const& fas)
+        : m_numPatterns(fas.size()), m_words((fas.size() + 63) / 64),
+          m_firstBytes(256 * m_words), m_lengths((kMaxLength + 1) * m_words) {
+        TraceScope trace("dispatch");
+        for (PatternId id = 0; id < fas.size(); ++id) {
+            add(id, fas[id]);
+        }
+    }
+
+    // Ids of the patterns that could fully match sv, ascending
+    std::vector<PatternId> candidates(std::string_view const sv) const {
+        std::vector<PatternId> ids;
+        forEachCandidate(sv, [&](PatternId id) {
+            ids.push_back(id);
+        });
+        return ids;
+    }
+
+    // Candidates that `verify(id, sv)` (e.g. pattern id's DFA or JitFunction) accepts
+    template <typename Verify>
+    std::vector<PatternId> search(std::string_view const sv, Verify verify) const {
+        std::vector<PatternId> found;
+        forEachCandidate(sv, [&](PatternId id) {
+            if (verify(id, sv)) {
+                found.push_back(id);
+            }
+        });
+        return found;
+    }
+
+    size_t numPatterns() const {
+        return m_numPatterns;
+    }
+
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        usage.tables = sizeof(*this) + MemoryUsage::bytes(m_firstBytes) + MemoryUsage::bytes(m_lengths);
+        return usage;
+    }
+
+private:
+    template <typename FA>
+    void add(PatternId id, FA const& fa) {
+        using StateRef = typename FA::StateRef;
+        auto live = liveStates(fa);
+        if (!live[fa.m_start]) {
+            return;
+        }
+        uint64_t const bit = uint64_t(1) << (id & 63);
+        size_t const word = id / 64;
+
+        fa.forEachEdge(fa.m_start, [&](char c, StateRef to) {
+            if (live[to]) {
+                m_firstBytes[uint8_t(c) * m_words + word] |= bit;
+            }
+        });
+
+        // the live states exactly `length` bytes in; every live state still reaches a match,
+        // so any left at kMaxLength means some longer input can match
+        std::vector<StateRef> states{fa.m_start};
+        std::vector<bool> seen(fa.numStates());
+        for (size_t length = 0; !states.empty(); ++length) {
+            if (length == kMaxLength) {
+                m_lengths[kMaxLength * m_words + word] |= bit;
+                break;
+            }
+            std::vector<StateRef> next;
+            for (auto state : states) {
+                if (fa.isMatch(state)) {
+                    m_lengths[length * m_words + word] |= bit;
+                }
+                fa.forEachEdge(state, [&](char, StateRef to) {
+                    if (live[to] && !seen[to]) {
+                        seen[to] = true;
+                        next.push_back(to);
+                    }
+                });
+            }
+            for (auto state : next) {
+                seen[state] = false;
+            }
+            states = std::move(next);
+        }
+    }
+
+    template <typename Func>
+    void forEachCandidate(std::string_view const sv, Func func) const {
+        auto lengths = &m_lengths[std::min(sv.size(), kMaxLength) * m_words];
+        auto firstBytes = sv.empty() ? nullptr : &m_firstBytes[uint8_t(sv[0]) * m_words];
+        for (size_t word = 0; word < m_words; ++word) {
+            uint64_t bits = lengths[word];
+            if (firstBytes) {
+                bits &= firstBytes[word];
+            }
+            while (bits) {
+                func(PatternId(word * 64 + __builtin_ctzll(bits)));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    size_t m_numPatterns;
+    size_t m_words;
+    std::vector<uint64_t> m_firstBytes; // 256 rows of m_words, one per first byte
+    std::vector<uint64_t> m_lengths;    // kMaxLength + 1 rows of m_words, one per length
+};
+
+// Compiles patterns once on behalf of other local processes.  Each compiled DFA is frozen
+// into a shared memory object; a client asks for a pattern by its toStr() over a
+// Unix-domain socket, gets the descriptor back (SCM_RIGHTS) and maps it read-only, so
+// every worker shares one physical copy and none of them pays for compilation.
+//
+// Protocol: the client sends a uint32 length and the pattern text; the server answers
+// with one status byte, carrying the descriptor when the status is 1.
+struct PatternServer {
+    // longest pattern name a client may send; longer requests are dropped unread
+    static constexpr uint32_t kMaxNameLength = 64 << 10;
+
+    explicit PatternServer(std::string socketPath) : m_socketPath(std::move(socketPath)) {
+        m_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(m_listener != -1);
+
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        assert(m_socketPath.size() < sizeof(addr.sun_path));
+        strncpy(addr.sun_path, m_socketPath.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(m_socketPath.c_str());
+        if (bind(m_listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(m_listener, 64) != 0) {
+            printf("[%s] Unable to listen on %s: %s\n", __FILE__, m_socketPath.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ~PatternServer() {
+        close(m_listener);
+        unlink(m_socketPath.c_str());
+        for (auto& [name, pattern] : m_patterns) {
+            if (pattern.fd != -1) {
+                close(pattern.fd);
+            }
+        }
+    }
+
+    // Register a combinator; it is compiled on first request.
+    template <typename Parser>
+    void add(Parser const& parser) {
+        m_patterns[parser.toStr()].compile = [parser]() {
+            return parser.toNFA().lower().freeze();
+        };
+    }
+
+    // Answer requests until `maxRequests` have been served (forever by default).
+    void serve(size_t maxRequests = SIZE_MAX) {
+        for (size_t served = 0; served < maxRequests; ++served) {
+            int conn = accept(m_listener, nullptr, nullptr);
+            if (conn == -1) {
+                continue;
+            }
+            std::string name;
+            if (readName(conn, name)) {
+                int fd = publish(name);
+                sendReply(conn, fd);
+            }
+            close(conn);
+        }
+    }
+
+private:
+    struct Pattern {
+        std::function<FrozenDFA()> compile;
+        int fd = -1;
+    };
+
+    // Shared memory object holding the pattern's frozen image, created on first use, or -1
+    // if it can't be.  Clients get a read-only descriptor of a read-only object, so none of
+    // them can write to the image the others map.
+    int publish(std::string const& name) {
+        auto it = m_patterns.find(name);
+        if (it == m_patterns.end()) {
+            return -1;
+        }
+        auto& pattern = it->second;
+        if (pattern.fd != -1) {
+            return pattern.fd;
+        }
+
+        std::ostringstream image;
+        pattern.compile().writeImage(image);
+        auto bytes = image.str();
+
+        auto shmName = "/automata." + std::to_string(getpid()) + "." + std::to_string(m_published++);
+        int writable = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (writable == -1) {
+            return -1;
+        }
+        int fd = -1;
+        if (ftruncate(writable, bytes.size()) == 0) {
+            void* addr = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_SHARED, writable, 0);
+            if (addr != MAP_FAILED) {
+                memcpy(addr, bytes.data(), bytes.size());
+                munmap(addr, bytes.size());
+                // nobody, this process included, can open it for writing from here on
+                if (fchmod(writable, 0400) == 0) {
+                    fd = shm_open(shmName.c_str(), O_RDONLY, 0);
+                }
+            }
+        }
+        shm_unlink(shmName.c_str());
+        close(writable);
+
+        pattern.fd = fd;
+        return fd;
+    }
+
+    static bool readName(int conn, std::string& name) {
+        uint32_t size;
+        if (recv(conn, &size, sizeof(size), MSG_WAITALL) != sizeof(size) || size > kMaxNameLength) {
+            return false;
+        }
+        name.resize(size);
+        return recv(conn, name.data(), size, MSG_WAITALL) == ssize_t(size);
+    }
+
+    static void sendReply(int conn, int fd) {
+        char status = fd != -1;
+        iovec iov = {&status, 1};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        if (fd != -1) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+        sendmsg(conn, &msg, 0);
+    }
+
+    std::string m_socketPath;
+    int m_listener;
+    std::unordered_map<std::string, Pattern> m_patterns;
+    int m_published = 0;
+};
+
+// Worker side of PatternServer
+struct PatternClient {
+    explicit PatternClient(std::string socketPath) : m_socketPath(std::move(socketPath)) {}
+
+    // Map the server's compiled DFA for the pattern, or nullopt if the server is unreachable,
+    // doesn't know it, or sends something that isn't a DFA image.
+    std::optional<FrozenDFA> fetch(std::string const& name) const {
+        int fd = fetchFd(name);
+        if (fd == -1) {
+            return std::nullopt;
+        }
+        auto dfa = FrozenDFA::openFd(fd);
+        close(fd);
+        return dfa;
+    }
+
+    // The (read-only) descriptor of the server's image for the pattern, or -1
+    int fetchFd(std::string const& name) const {
+        int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, m_socketPath.c_str(), sizeof(addr.sun_path) - 1);
+        if (connect(conn, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(conn);
+            return -1;
+        }
+
+        uint32_t size = name.size();
+        send(conn, &size, sizeof(size), 0);
+        send(conn, name.data(), size, 0);
+
+        char status = 0;
+        iovec iov = {&status, 1};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto received = recvmsg(conn, &msg, MSG_WAITALL);
+        close(conn);
+
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        if (received != 1 || !status || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+            return -1;
+        }
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        return fd;
+    }
+
+private:
+    std::string m_socketPath;
+};
+
+// Patterns the stand-alone server (`./a.out --serve <socket>`) compiles for its clients
+void addBuiltinPatterns(PatternServer& server) {
+    server.add(And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')));
+    auto ab = Or(Char('a'), Char('b'));
+    server.add(And(OneOrMore(ab), And(Char('a'), And(ab, ab))));
+}
+
+// Records of some input file, [begin, end) in bytes.  Shard boundaries sit just past a
+// delimiter so no record straddles two shards.
+struct Shard {
+    size_t file;
+    size_t begin;
+    size_t end;
+};
+
+struct ShardedScanResult {
+    uint64_t records = 0;
+    uint64_t matches = 0;
+    // byte offsets of the matching records per input file, ascending (when collected)
+    std::vector<std::vector<uint64_t>> offsets;
+};
+
+// Scans large inputs with a frozen DFA across worker processes.  The coordinator publishes
+// the automaton in shared memory and cuts the inputs into record-aligned shards; the
+// workers share read-only mappings of the automaton and the inputs, claim shards from a
+// shared counter and stream the offsets of matching records back through their own
+// shared-memory rings, which the coordinator drains and merges while the workers run.
+//
+// Workers are forked by default.  With `Options::local` they are threads of this process
+// instead - the stand-in for running workers on other hosts - and the coordinator does
+// exactly the same planning, draining and merging.
+//
+// Forked mode is meant for a single-threaded caller: fork() copies only the calling thread,
+// and a lock (the allocator's, say) held by another thread at that moment stays held in the
+// child.  run() therefore maps everything before forking, and a forked worker only reads
+// those mappings and writes its ring - it never allocates or takes a lock - so it is safe
+// even then, but other threads' state is not carried into the workers.
+struct ShardedScan {
+    struct Options {
+        int workers = 4;
+        // shards per worker, so that fast workers pick up the slack of slow ones
+        int shardsPerWorker = 4;
+        bool offsets = false;
+        size_t ringSlots = 4096;
+        bool local = false;
+        char delimiter = '\n';
+    };
+
+    ShardedScan(FrozenDFA const& dfa, std::vector<std::string> paths, Options options)
+        : m_paths(std::move(paths)), m_options(options) {
+        assert(m_options.workers > 0 && m_options.ringSlots > 0);
+        std::ostringstream image;
+        dfa.writeImage(image);
+        auto bytes = image.str();
+
+        auto shmName = "/automata.shard." + std::to_string(getpid()) + "." + std::to_string(counter()++);
+        m_image = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        assert(m_image != -1 && "unable to create shared memory");
+        shm_unlink(shmName.c_str());
+        if (ftruncate(m_image, bytes.size()) != 0) {
+            printf("unable to size shared automaton\n");
+            exit(EXIT_FAILURE);
+        }
+        void* addr = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_SHARED, m_image, 0);
+        assert(addr != MAP_FAILED);
+        memcpy(addr, bytes.data(), bytes.size());
+        munmap(addr, bytes.size());
+    }
+
+    ~ShardedScan() {
+        close(m_image);
+    }
+
+    ShardedScan(ShardedScan const&) = delete;
+    ShardedScan& operator=(ShardedScan const&) = delete;
+
+    // Cut every input into about `pieces` shards, moving each cut forward to just past the
+    // next delimiter.
+    std::vector<Shard> plan(size_t pieces) const {
+        std::vector<Shard> shards;
+        for (size_t file = 0; file < m_paths.size(); ++file) {
+            size_t size = fileSize(m_paths[file]);
+            if (size == 0) {
+                continue;
+            }
+            auto mapping = mapInput(m_paths[file]);
+            auto data = static_cast<char const*>(mapping.get());
+            size_t begin = 0;
+            for (size_t i = 1; i <= pieces && begin < size; ++i) {
+                size_t end = size * i / pieces;
+                if (end <= begin) {
+                    continue;
+                }
+                if (end < size) {
+                    end += kernels().findByte(data + end - 1, size - end + 1, m_options.delimiter);
+                    end = std::min(end, size);
+                }
+                shards.push_back({file, begin, end});
+                begin = end;
+            }
+        }
+        return shards;
+    }
+
+    ShardedScanResult run() {
+        TraceScope trace("shard.scan", "match");
+        size_t numWorkers = m_options.workers;
+        auto shards = plan(numWorkers * m_options.shardsPerWorker);
+
+        // everything a worker reads, mapped up front (forked workers must not allocate)
+        auto image = FrozenDFA::mapImage(m_image);
+        if (!image) {
+            printf("unable to map shared automaton\n");
+            exit(EXIT_FAILURE);
+        }
+        FrozenDFA const dfa(std::move(image));
+        std::vector<std::shared_ptr<void const>> inputs(m_paths.size());
+        std::vector<char const*> data(m_paths.size());
+        for (auto& shard : shards) {
+            if (!inputs[shard.file]) {
+                inputs[shard.file] = mapInput(m_paths[shard.file]);
+                data[shard.file] = static_cast<char const*>(inputs[shard.file].get());
+            }
+        }
+
+        size_t ringBytes = sizeof(Ring) + sizeof(Slot) * m_options.ringSlots;
+        size_t bytes = sizeof(std::atomic<uint64_t>) + ringBytes * numWorkers;
+        void* shared = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        assert(shared != MAP_FAILED && "unable to map result rings");
+        static_assert(std::atomic<uint64_t>::is_always_lock_free, "rings are shared between processes");
+        auto nextShard = new (shared) std::atomic<uint64_t>(0);
+        std::vector<Ring*> rings;
+        for (size_t w = 0; w < numWorkers; ++w) {
+            auto at = static_cast<char*>(shared) + sizeof(std::atomic<uint64_t>) + ringBytes * w;
+            rings.push_back(new (at) Ring());
+        }
+
+        std::vector<pid_t> pids;
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < numWorkers; ++w) {
+            if (m_options.local) {
+                threads.emplace_back([&, w] { work(shards, dfa, data, *nextShard, *rings[w]); });
+                continue;
+            }
+            pid_t pid = fork();
+            if (pid == -1) {
+                printf("unable to fork scan worker\n");
+                exit(EXIT_FAILURE);
+            }
+            if (pid == 0) {
+                work(shards, dfa, data, *nextShard, *rings[w]);
+                _exit(0);
+            }
+            pids.push_back(pid);
+        }
+
+        ShardedScanResult result;
+        result.offsets.resize(m_paths.size());
+        size_t finished = 0;
+        std::vector<bool> done(numWorkers);
+        while (finished < numWorkers) {
+            bool progress = false;
+            for (size_t w = 0; w < numWorkers; ++w) {
+                if (done[w]) {
+                    continue;
+                }
+                // read the flag before draining: once set, the ring holds everything left
+                bool last = rings[w]->done.load(std::memory_order_acquire);
+                progress |= drain(*rings[w], result);
+                if (last) {
+                    result.records += rings[w]->records;
+                    result.matches += rings[w]->matches;
+                    done[w] = true;
+                    ++finished;
+                } else if (!m_options.local) {
+                    checkAlive(pids[w], *rings[w]);
+                }
+            }
+            if (!progress) {
+                std::this_thread::yield();
+            }
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (auto pid : pids) {
+            if (pid == -1) {
+                continue;
+            }
+            int status = 0;
+            waitpid(pid, &status, 0);
+            assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+        munmap(shared, bytes);
+
+        for (auto& offsets : result.offsets) {
+            std::sort(offsets.begin(), offsets.end());
+        }
+        return result;
+    }
+
+private:
+    struct Slot {
+        uint64_t file;
+        uint64_t offset;
+    };
+
+    // Single producer (one worker), single consumer (the coordinator).  ringSlots Slots
+    // follow the header in the shared mapping; see slots().
+    struct Ring {
+        std::atomic<uint64_t> head{0};
+        std::atomic<uint64_t> tail{0};
+        std::atomic<bool> done{false};
+        // final tallies, valid once done is set
+        uint64_t records = 0;
+        uint64_t matches = 0;
+    };
+    static_assert(sizeof(Ring) % alignof(Slot) == 0, "slots follow the ring header");
+
+    static Slot* slots(Ring& ring) {
+        return reinterpret_cast<Slot*>(reinterpret_cast<char*>(&ring) + sizeof(Ring));
+    }
+
+    // runs in a forked child too: no allocation, no locks
+    void work(std::vector<Shard> const& shards, FrozenDFA const& dfa, std::vector<char const*> const& inputs,
+              std::atomic<uint64_t>& nextShard, Ring& ring) const {
+        uint64_t records = 0;
+        uint64_t matches = 0;
+
+        for (size_t s; (s = nextShard.fetch_add(1, std::memory_order_relaxed)) < shards.size(); ) {
+            auto& shard = shards[s];
+            auto data = inputs[shard.file];
+            size_t pos = shard.begin;
+            while (pos < shard.end) {
+                size_t end = pos + kernels().findByte(data + pos, shard.end - pos, m_options.delimiter);
+                ++records;
+                if (dfa.testMatch(std::string_view(data + pos, end - pos))) {
+                    ++matches;
+                    if (m_options.offsets) {
+                        push(ring, {shard.file, pos});
+                    }
+                }
+                pos = end + 1;
+            }
+        }
+
+        ring.records = records;
+        ring.matches = matches;
+        ring.done.store(true, std::memory_order_release);
+    }
+
+    void push(Ring& ring, Slot slot) const {
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        while (head - ring.tail.load(std::memory_order_acquire) == m_options.ringSlots) {
+            std::this_thread::yield();
+        }
+        slots(ring)[head % m_options.ringSlots] = slot;
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    bool drain(Ring& ring, ShardedScanResult& result) const {
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        for (uint64_t i = tail; i < head; ++i) {
+            auto& slot = slots(ring)[i % m_options.ringSlots];
+            result.offsets[slot.file].push_back(slot.offset);
+        }
+        ring.tail.store(head, std::memory_order_release);
+        return head != tail;
+    }
+
+    // A worker that died can never finish its ring.  One that did finish is reaped here
+    // and its pid cleared.
+    static void checkAlive(pid_t& pid, Ring const& ring) {
+        int status = 0;
+        if (pid == -1 || waitpid(pid, &status, WNOHANG) != pid) {
+            return;
+        }
+        if (!ring.done.load(std::memory_order_acquire) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("scan worker %d exited before finishing\n", int(pid));
+            exit(EXIT_FAILURE);
+        }
+        pid = -1;
+    }
+
+    static std::shared_ptr<void const> mapInput(std::string const& path) {
+        auto mapping = FrozenDFA::mapFile(path);
+        if (!mapping) {
+            printf("unable to map %s\n", path.c_str());
+            exit(EXIT_FAILURE);
+        }
+        return mapping;
+    }
+
+    static size_t fileSize(std::string const& path) {
+        struct stat st;
+        int ok = stat(path.c_str(), &st);
+        assert(ok == 0 && "unable to stat input");
+        return st.st_size;
+    }
+
+    static size_t& counter() {
+        static size_t n = 0;
+        return n;
+    }
+
+    std::vector<std::string> m_paths;
+    Options m_options;
+    int m_image;
+};
+
+bool basicTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Basic Tests" << std::endl;
+
+    Benchmark benchmark({
+        "aba", "abb", "aa", "ab", "a",
+        "aaa", "aab", "baa", "bba", "bbb", "ba", "bb", "b", "c",
+        "blah blah blah", "abaracadabara"
+    });
+
+    NFA nfa;
+
+    auto s1 = nfa.addState();
+    auto s2 = nfa.addState();
+    auto s3 = nfa.addState();
+    auto s4 = nfa.addState();
+    auto s5 = nfa.addState();
+
+    nfa.addEdge(s1, std::nullopt, s2);
+    nfa.addEdge(s1, 'a', s3);
+    nfa.addEdge(s2, 'a', s4);
+    nfa.addEdge(s2, 'a', s5);
+    nfa.addEdge(s3, 'b', s4);
+    nfa.addEdge(s4, 'a', s5);
+    nfa.addEdge(s4, 'b', s5);
+
+    nfa.setStart(s1);
+    nfa.addMatch(s5);
+
+    assert(nfa.testMatch("a"));
+    assert(nfa.testMatch("ab"));
+    assert(nfa.testMatch("abb"));
+    assert(!nfa.testMatch("c"));
+    assert(!nfa.testMatch("abbb"));
+
+    std::cout << "NFA" << std::endl;
+    nfa.print();
+    int nfa_count = benchmark([&](auto const& str) {
+        return nfa.testMatch(str);
+    });
+    std::cout << nfa_count << std::endl;
+
+    DFA dfa = nfa.lower();
+
+    assert(dfa.testMatch("a"));
+    assert(dfa.testMatch("ab"));
+    assert(dfa.testMatch("abb"));
+    assert(!dfa.testMatch("c"));
+    assert(!dfa.testMatch("abbb"));
+
+    std::cout << "DFA" << std::endl;
+    dfa.print();
+    int dfa_count = benchmark([&](auto const& str) {
+        return dfa.testMatch(str);
+    });
+    std::cout << dfa_count << std::endl;
+
+    JitFunction jfn(dfa);
+
+    assert(jfn("a"));
+    assert(jfn("ab"));
+    assert(jfn("abb"));
+    assert(!jfn("c"));
+    assert(!jfn("abbb"));
+
+    std::cout << "JIT" << std::endl;
+    int jit_count = benchmark([&](auto const& str) {
+        return jfn(str);
+    });
+    std::cout << jit_count << std::endl;
+
+    return jit_count == dfa_count && dfa_count == nfa_count;
+}
+
+bool regexTests() {
+    // a(bb)+a (the same example as the article linked at the top of this file)
+
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Regex Tests" << std::endl;
+    
+    Benchmark benchmark({
+        "aa", "aba", "abba", "abbba", "abbbba", "abbbbbbbbbbbbbbbbbbbba", "abbbbbbbbbbbbbbbbbba"
+        "blah blah blah", "abaracadabara", "crapola"
+    });
+
+    auto parser = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+
+    auto str = parser.toStr();
+    std::cout << "Regex as string: " << str << std::endl;
+
+    const std::regex stl_regex(str);
+    
+    int stl_count = benchmark([&](auto const& str) {
+        return std::regex_match(str, stl_regex);
+    });
+    std::cout << stl_count << std::endl;
+
+    auto nfa = parser.toNFA();
+
+    assert(!nfa.testMatch("aa"));
+    assert(!nfa.testMatch("aba"));
+    assert(nfa.testMatch("abba"));
+    assert(!nfa.testMatch("abbba"));
+    assert(nfa.testMatch("abbbba"));
+
+    std::cout << "Regex as NFA:" << std::endl;
+    // You can see in this printout that this NFA has a lot of unnecessary epsilon transitions
+    nfa.print();
+    int nfa_count = benchmark([&](auto const& str) {
+        return nfa.testMatch(str);
+    });
+    std::cout << nfa_count << std::endl;
+
+    auto dfa = nfa.lower();
+
+    assert(!dfa.testMatch("aa"));
+    assert(!dfa.testMatch("aba"));
+    assert(dfa.testMatch("abba"));
+    assert(!dfa.testMatch("abbba"));
+    assert(dfa.testMatch("abbbba"));
+
+
+    std::cout << "Regex as DFA:" << std::endl;
+    dfa.print();
+    int dfa_count = benchmark([&](auto const& str) {
+        return dfa.testMatch(str);
+    });
+    
+    JitFunction jfn(dfa);
+
+
+    assert(!jfn("aa"));
+    assert(!jfn("aba"));
+    assert(jfn("abba"));
+    assert(!jfn("abbba"));
+    assert(jfn("abbbba"));
+
+    std::cout << "JIT" << std::endl;
+    int jit_count = benchmark([&](auto const& str) {
+        return jfn(str);
+    });
+    std::cout << jit_count << std::endl;
+
+    // an alternation inside a concatenation prints as one group (see Or::toStr)
+    auto prefixed = And(Char('x'), Or(Char('a'), Char('b')));
+    assert(prefixed.toStr() == "x((a)|(b))");
+    auto prefixedNfa = prefixed.toNFA();
+    const std::regex prefixedRegex(prefixed.toStr());
+    bool agree = true;
+    for (auto str : {"", "x", "xa", "xb", "a", "b", "xab"}) {
+        agree = agree && std::regex_match(str, prefixedRegex) == prefixedNfa.testMatch(str);
+    }
+    // the old ungrouped form matches "b" on its own, which the pattern doesn't
+    assert(std::regex_match("b", std::regex("x(a)|(b)")) && !prefixedNfa.testMatch("b"));
+
+    return agree && jit_count == dfa_count && dfa_count == nfa_count && nfa_count == stl_count;
+}
+
+bool frozenTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Frozen Tests" << std::endl;
+
+    Benchmark benchmark({
+        "aa", "aba", "abba", "abbba", "abbbba", "abbbbbbbbbbbbbbbbbbbba",
+        "blah blah blah", "abaracadabara", "crapola"
+    });
+
+    auto parser = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    auto nfa = parser.toNFA();
+    auto frozenNfa = nfa.freeze();
+
+    assert(frozenNfa.numStates() == nfa.numStates());
+    assert(!frozenNfa.testMatch("aa"));
+    assert(frozenNfa.testMatch("abba"));
+    assert(!frozenNfa.testMatch("abbba"));
+    assert(frozenNfa.testMatch("abbbba"));
+
+    auto dfa = nfa.lower();
+    auto frozenDfa = frozenNfa.lower().freeze();
+
+    assert(!frozenDfa.testMatch("aa"));
+    assert(frozenDfa.testMatch("abba"));
+    assert(!frozenDfa.testMatch("abbba"));
+    assert(frozenDfa.testMatch("abbbba"));
+
+    std::cout << "DFA" << std::endl;
+    int dfa_count = benchmark([&](auto const& str) {
+        return dfa.testMatch(str);
+    });
+    std::cout << dfa_count << std::endl;
+
+    std::cout << "Frozen DFA" << std::endl;
+    int frozen_count = benchmark([&](auto const& str) {
+        return frozenDfa.testMatch(str);
+    });
+    std::cout << frozen_count << std::endl;
+
+    return frozen_count == dfa_count;
+}
+
+bool memoryTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Memory Usage Tests" << std::endl;
+
+    auto nfa = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')).toNFA();
+    auto frozenNfa = nfa.freeze();
+    auto dfa = nfa.lower();
+    auto frozenDfa = dfa.freeze();
+    JitFunction jfn(dfa);
+
+    std::cout << "NFA memory: ";
+    nfa.memoryUsage().print(std::cout);
+    std::cout << "Frozen NFA memory: ";
+    frozenNfa.memoryUsage().print(std::cout);
+    std::cout << "DFA memory: ";
+    dfa.memoryUsage().print(std::cout);
+    std::cout << "Frozen DFA memory: ";
+    frozenDfa.memoryUsage().print(std::cout);
+    std::cout << "JIT memory: ";
+    jfn.memoryUsage().print(std::cout);
+
+    // per pattern cost is the sum over everything built for it
+    MemoryUsage pattern = nfa.memoryUsage();
+    pattern += dfa.memoryUsage();
+    std::cout << "Pattern memory: ";
+    pattern.print(std::cout);
+
+    assert(frozenNfa.memoryUsage().edges < nfa.memoryUsage().edges);
+    assert(frozenDfa.memoryUsage().total() < dfa.memoryUsage().total());
+    assert(pattern.total() == nfa.memoryUsage().total() + dfa.memoryUsage().total());
+    assert(jfn.memoryUsage().code > 0);
+
+    return true;
+}
+
+bool reduceTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Reduce Tests" << std::endl;
+
+    auto regex = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')).toNFA();
+    auto reduced = regex.reduce();
+
+    std::cout << "Regex NFA: " << regex.numStates() << " states, reduced: " << reduced.numStates() << std::endl;
+    reduced.print();
+    assert(reduced.numStates() < regex.numStates());
+
+    // both branches share the "c" continuation, which forward bisimulation merges
+    auto shared = And(Or(Char('a'), Char('b')), Char('c')).toNFA();
+    auto sharedReduced = shared.reduce();
+
+    std::cout << "Shared tail NFA: " << shared.numStates() << " states, reduced: " << sharedReduced.numStates() << std::endl;
+    assert(sharedReduced.numStates() == 3);
+
+    // the Matcher's engines are all built from the reduced NFA
+    auto sharedMatcher = Matcher::compile(Or(And(Char('a'), Char('c')), And(Char('b'), Char('c'))));
+    auto sharedUnreduced = Or(And(Char('a'), Char('c')), And(Char('b'), Char('c'))).toNFA();
+    std::cout << "Shared tail Matcher: " << sharedMatcher.nfa().numStates() << " states, unreduced: " << sharedUnreduced.numStates() << std::endl;
+    assert(sharedMatcher.nfa().numStates() < sharedUnreduced.numStates());
+    assert(sharedMatcher.nfa().numStates() == 3);
+
+    bool ok = true;
+    for (auto str : {"", "a", "ab", "ac", "bc", "cc", "abba", "abbba", "abbbba", "abbbbbbbba", "abbbbbbbbba"}) {
+        ok = ok && sharedMatcher(str) == sharedUnreduced.testMatch(str);
+        ok = ok && regex.testMatch(str) == reduced.testMatch(str);
+        ok = ok && regex.testMatch(str) == reduced.lower().testMatch(str);
+        ok = ok && shared.testMatch(str) == sharedReduced.testMatch(str);
+    }
+    return ok;
+}
+
+bool offlineTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Offline Lowering Tests" << std::endl;
+
+    // (a|b)+a(a|b)(a|b): the DFA has to remember the last four characters
+    auto ab = Or(Char('a'), Char('b'));
+    auto nfa = And(OneOrMore(ab), And(Char('a'), And(ab, ab))).toNFA();
+
+    auto dfa = nfa.lower();
+    OfflineLowerStats stats;
+    // a tiny budget so the frontier has to spill
+    auto offline = nfa.lowerOffline("offline_dfa.bin", /*budget*/16, &stats);
+    assert(offline);
+
+    std::cout << "states: " << stats.states << " edges: " << stats.edges << " spilled: " << stats.spilled
+              << " cache bytes: " << stats.cacheBytes << std::endl;
+    assert(stats.states == dfa.numStates());
+    assert(stats.spilled > 0);
+
+    // round trip a frozen image through a file too
+    {
+        std::ofstream out("frozen_dfa.bin", std::ios::binary);
+        dfa.freeze().writeImage(out);
+    }
+    auto mapped = FrozenDFA::openFile("frozen_dfa.bin");
+    assert(mapped);
+
+    // anything but a whole, consistent DFA image is turned away
+    std::string bytes;
+    {
+        std::ifstream in("frozen_dfa.bin", std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    size_t headerBytes = 5 * sizeof(uint64_t);
+    assert(FrozenDFA::isImage(bytes.data(), bytes.size()));
+    assert(!FrozenDFA::isImage(bytes.data(), bytes.size() - 1));
+    assert(!FrozenDFA::isImage(bytes.data(), headerBytes));
+    assert(!FrozenNFA::isImage(bytes.data(), bytes.size()));
+    auto corrupt = [&](size_t at, auto value) {
+        auto copy = bytes;
+        memcpy(copy.data() + at, &value, sizeof(value));
+        return FrozenDFA::isImage(copy.data(), copy.size());
+    };
+    // the version, the second offset, then the first target
+    assert(!corrupt(sizeof(uint64_t), 0));
+    assert(!corrupt(headerBytes + sizeof(uint64_t), ~uint64_t(0)));
+    assert(!corrupt(headerBytes + sizeof(uint64_t) * (dfa.numStates() + 1), int(dfa.numStates())));
+    assert(!FrozenDFA::openFile("no_such_image.bin"));
+    {
+        std::ofstream out("frozen_dfa_bad.bin", std::ios::binary);
+        out << "not an automaton";
+    }
+    assert(!FrozenDFA::openFile("frozen_dfa_bad.bin"));
+    std::remove("frozen_dfa_bad.bin");
+
+    bool ok = true;
+    for (int len = 0; len <= 8; ++len) {
+        for (int bits = 0; bits < (1 << len); ++bits) {
+            std::string str;
+            for (int i = 0; i < len; ++i) {
+                str.push_back(bits & (1 << i) ? 'a' : 'b');
+            }
+            bool expected = nfa.testMatch(str);
+            ok = ok && dfa.testMatch(str) == expected;
+            ok = ok && offline->testMatch(str) == expected;
+            ok = ok && mapped->testMatch(str) == expected;
+        }
+    }
+    ok = ok && !offline->testMatch("abac") && !mapped->testMatch("abac");
+
+    // with no memory budget at all every frontier entry goes through the disk
+    OfflineLowerStats diskOnly;
+    auto unbuffered = nfa.lowerOffline("offline_dfa0.bin", /*budget*/0, &diskOnly);
+    ok = ok && diskOnly.states == dfa.numStates() && diskOnly.spilled == diskOnly.states;
+    ok = ok && unbuffered && unbuffered->testMatch("abbaab") == dfa.testMatch("abbaab");
+    std::remove("offline_dfa0.bin");
+
+    std::remove("offline_dfa.bin");
+    std::remove("frozen_dfa.bin");
+    return ok;
+}
+
+bool budgetTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Budget Tests" << std::endl;
+
+    auto nfa = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')).toNFA();
+    auto dfa = nfa.lower();
+    auto frozenDfa = dfa.freeze();
+    JitFunction jfn(dfa);
+
+    // 64KB of input, so a 4KB budget needs 16 calls to get through
+    std::string longMatch = "a" + std::string(1 << 16, 'b') + "a";
+    std::string longMiss = longMatch + "a";
+
+    MatchBudget budget;
+    budget.bytes = 2 * MatchBudget::kCheckInterval;
+
+    // call a budgeted engine until it finishes, counting the rounds
+    auto finish = [&](auto const& begin, auto const& resume, std::string_view sv) {
+        auto result = begin(sv);
+        int rounds = 1;
+        while (result.status == MatchStatus::BudgetExceeded) {
+            assert(result.pos <= sv.size());
+            result = resume(sv, std::move(result));
+            ++rounds;
+        }
+        return std::make_pair(result.status, rounds);
+    };
+
+    bool ok = true;
+    for (auto& str : {longMatch, longMiss}) {
+        auto expected = dfa.testMatch(str) ? MatchStatus::Match : MatchStatus::NoMatch;
+        auto expectedRounds = str.size() / budget.bytes + 1;
+
+        auto dfaResult = finish([&](auto sv) { return dfa.testMatch(sv, budget); },
+            [&](auto sv, auto from) { return dfa.resume(sv, from, budget); }, str);
+        auto frozenResult = finish([&](auto sv) { return frozenDfa.testMatch(sv, budget); },
+            [&](auto sv, auto from) { return frozenDfa.resume(sv, from, budget); }, str);
+        auto nfaResult = finish([&](auto sv) { return nfa.testMatch(sv, budget); },
+            [&](auto sv, auto from) { return nfa.resume(sv, std::move(from), budget); }, str);
+        auto jitResult = finish([&](auto sv) { return jfn(sv, budget); },
+            [&](auto sv, auto from) { return jfn.resume(sv, from, budget); }, str);
+
+        for (auto result : {dfaResult, frozenResult, nfaResult, jitResult}) {
+            ok = ok && result.first == expected;
+            ok = ok && result.second == expectedRounds;
+        }
+    }
+
+    // a dead end is reported straight away, whatever is left of the input
+    ok = ok && dfa.testMatch("c" + longMatch, budget).status == MatchStatus::NoMatch;
+    ok = ok && jfn("c" + longMatch, budget).status == MatchStatus::NoMatch;
+
+    // a deadline in the past stops every engine before its first chunk
+    MatchBudget expired;
+    expired.deadline = std::chrono::steady_clock::now();
+    ok = ok && dfa.testMatch(longMatch, expired).status == MatchStatus::BudgetExceeded;
+    ok = ok && nfa.testMatch(longMatch, expired).status == MatchStatus::BudgetExceeded;
+    ok = ok && jfn(longMatch, expired).status == MatchStatus::BudgetExceeded;
+    ok = ok && jfn(longMatch, expired).pos == 0;
+
+    // resuming mid-input with only a deadline (no byte limit) runs to the end
+    MatchBudget deadlineOnly;
+    deadlineOnly.deadline = std::chrono::steady_clock::now() + std::chrono::hours(1);
+    auto stopped = dfa.testMatch(longMatch, budget);
+    ok = ok && stopped.status == MatchStatus::BudgetExceeded && stopped.pos > 0;
+    ok = ok && dfa.resume(longMatch, stopped, deadlineOnly).status == MatchStatus::Match;
+    ok = ok && frozenDfa.resume(longMatch, frozenDfa.testMatch(longMatch, budget), deadlineOnly).status == MatchStatus::Match;
+    ok = ok && nfa.resume(longMatch, nfa.testMatch(longMatch, budget), deadlineOnly).status == MatchStatus::Match;
+
+    return ok;
+}
+
+bool serverTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Pattern Server Tests" << std::endl;
+
+    auto parser = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    std::string socketPath = "automata_test.sock";
+
+    // the server runs in its own process, like the stand-alone daemon
+    pid_t pid = fork();
+    if (pid == 0) {
+        PatternServer server(socketPath);
+        addBuiltinPatterns(server);
+        server.serve(/*maxRequests*/5);
+        _exit(0);
+    }
+
+    PatternClient client(socketPath);
+    std::optional<FrozenDFA> dfa;
+    for (int attempt = 0; attempt < 100 && !dfa; ++attempt) {
+        dfa = client.fetch(parser.toStr());
+        if (!dfa) {
+            usleep(10000);
+        }
+    }
+    auto again = client.fetch(parser.toStr());
+    auto unknown = client.fetch("nope");
+
+    // the image can be mapped for reading only
+    int fd = client.fetchFd(parser.toStr());
+    bool readOnly = fd != -1 && (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY;
+    readOnly = readOnly && mmap(nullptr, 1, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED;
+    if (fd != -1) {
+        close(fd);
+    }
+
+    // a name longer than the server accepts gets the connection closed, not an allocation
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    bool refused = connect(conn, (sockaddr*)&addr, sizeof(addr)) == 0;
+    uint32_t size = PatternServer::kMaxNameLength + 1;
+    refused = refused && send(conn, &size, sizeof(size), MSG_NOSIGNAL) == sizeof(size);
+    char status = 0;
+    refused = refused && recv(conn, &status, 1, MSG_WAITALL) == 0;
+    close(conn);
+
+    int exitStatus = 0;
+    waitpid(pid, &exitStatus, 0);
+    // the server _exit()s without running its destructor
+    unlink(socketPath.c_str());
+
+    bool ok = dfa && again && !unknown && readOnly && refused && WIFEXITED(exitStatus) && WEXITSTATUS(exitStatus) == 0;
+    if (ok) {
+        std::cout << "fetched " << dfa->numStates() << " states" << std::endl;
+        ok = !dfa->testMatch("aa") && dfa->testMatch("abba") && !dfa->testMatch("abbba") && dfa->testMatch("abbbba");
+        ok = ok && again->testMatch("abbbba");
+    }
+    return ok;
+}
+
+bool trigramTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Trigram Index Tests" << std::endl;
+
+    auto parser = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    auto query = parser.trigrams().query();
+    std::cout << "Query for " << parser.toStr() << ": " << query.toStr() << std::endl;
+    assert(query.toStr() == "\"abb\" \"bba\"");
+
+    auto alternation = Or(And(Char('a'), And(Char('b'), Char('c'))), And(Char('x'), And(Char('y'), Char('z'))));
+    std::cout << "Query for " << alternation.toStr() << ": " << alternation.trigrams().query().toStr() << std::endl;
+    assert(alternation.trigrams().query().toStr() == "\"abc\" | \"xyz\"");
+    assert(Maybe(Char('a')).trigrams().query().op == TrigramQuery::Op::All);
+
+    srand(0);
+    std::vector<std::string> docs;
+    for (int i = 0; i < 20000; ++i) {
+        if (i % 100 == 0) {
+            docs.push_back("a" + std::string(2 * (1 + rand() % 5), 'b') + "a");
+            continue;
+        }
+        std::string doc;
+        for (int len = 4 + rand() % 12; len; --len) {
+            doc.push_back('a' + rand() % 26);
+        }
+        docs.push_back(doc);
+    }
+    TrigramIndex index(docs);
+
+    auto dfa = parser.toNFA().lower();
+    auto candidates = index.candidates(query);
+    auto found = index.search(query, [&](std::string const& doc) {
+        return dfa.testMatch(doc);
+    });
+
+    size_t expected = 0;
+    for (auto& doc : docs) {
+        expected += dfa.testMatch(doc);
+    }
+    std::cout << "candidates: " << candidates.size() << " of " << docs.size() << ", matches: " << found.size() << std::endl;
+
+    return found.size() == expected && candidates.size() < docs.size() / 20;
+}
+
+bool bitStateTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "BitState Tests" << std::endl;
+
+    Benchmark benchmark({
+        "aa", "aba", "abba", "abbba", "abbbba", "abbbbbbbbbbbbbbbbbbbba",
+        "blah blah blah", "abaracadabara", "crapola"
+    });
+
+    // a((bb)+)a, capturing the repetition and its last iteration
+    auto parser = And(And(Char('a'), Capture(1, OneOrMore(Capture(2, And(Char('b'), Char('b')))))), Char('a'));
+    auto nfa = parser.toNFA();
+    BitState bitState(nfa);
+    assert(bitState.numGroups() == 3);
+
+    std::vector<int> caps;
+    assert(!bitState.match("aa"));
+    assert(!bitState.match("abbba"));
+    assert(bitState.match("abbbba", &caps));
+    assert((caps == std::vector<int>{0, 6, 1, 5, 3, 5}));
+
+    auto either = Or(Capture(1, Char('a')), Capture(2, Char('b')));
+    auto eitherNfa = either.toNFA();
+    assert(BitState(eitherNfa).match("b", &caps));
+    assert((caps == std::vector<int>{0, 1, -1, -1, 0, 1}));
+
+    Matcher matcher = Matcher::compile(parser);
+    assert(matcher("abbbba") && !matcher("abbba"));
+    assert(matcher.captures("abba") == (std::vector<int>{0, 4, 1, 3, 1, 3}));
+    assert(!matcher.captures("aba"));
+    assert(BitState::fitsOnStack(nfa.numStates(), 30));
+
+    // the NFA engine picks BitState for short inputs by itself
+    matcher.setEngine(Engine::NFA);
+    assert(matcher.engineFor(30) == Engine::BitState && matcher.engineFor(1 << 20) == Engine::NFA);
+    assert(matcher("abbbba") && !matcher("abbba"));
+    assert(matcher("a" + std::string(1 << 14, 'b') + "a") && !matcher("a" + std::string((1 << 14) + 1, 'b') + "a"));
+    matcher.setEngine(Engine::DFA);
+    assert(matcher.engineFor(30) == Engine::DFA);
+
+    // long inputs fall back to a heap bitmap but give the same answer
+    std::string longMatch = "a" + std::string(1 << 12, 'b') + "a";
+    assert(matcher.captures(longMatch) == (std::vector<int>{0, int(longMatch.size()), 1, int(longMatch.size()) - 1,
+        int(longMatch.size()) - 3, int(longMatch.size()) - 1}));
+
+    // past the cap the bitmap isn't allocated at all: the automata decide, without positions
+    size_t tooLong = BitState::kMaxBits / nfa.numStates();
+    std::string hugeMatch = "a" + std::string(tooLong - tooLong % 2, 'b') + "a";
+    assert(!BitState::fits(nfa.numStates(), hugeMatch.size()));
+    assert(bitState.match(hugeMatch, &caps) && caps.empty());
+    assert(!bitState.match(hugeMatch + "a"));
+    assert(matcher.captures(hugeMatch) == std::vector<int>() && !matcher.captures(hugeMatch + "a"));
+    matcher.setEngine(Engine::BitState);
+    assert(matcher.engineFor(hugeMatch.size()) == Engine::DFA && matcher(hugeMatch));
+    matcher.setEngine(Engine::DFA);
+
+    std::cout << "NFA" << std::endl;
+    int nfa_count = benchmark([&](auto const& str) {
+        return nfa.testMatch(str);
+    });
+    std::cout << nfa_count << std::endl;
+
+    std::cout << "BitState" << std::endl;
+    int bitstate_count = benchmark([&](auto const& str) {
+        return bitState.match(str, &caps);
+    });
+    std::cout << bitstate_count << std::endl;
+
+    return bitstate_count == nfa_count;
+}
+
+// Run one pattern and workload through every engine here and every baseline library that
+// was built in.  All of them do anchored full matches.  Returns whether they all agree.
+template <typename Parser>
+bool runBaselines(Parser const& parser, std::vector<std::string> cases) {
+    Benchmark benchmark(std::move(cases));
+    auto pattern = parser.toStr();
+    std::cout << "Pattern: " << pattern << std::endl;
+
+    std::vector<std::pair<std::string, int>> counts;
+    auto run = [&](std::string name, auto func) {
+        std::cout << name << ": ";
+        counts.push_back({name, benchmark(func)});
+    };
+
+    std::regex stl_regex(pattern);
+    run("std::regex", [&](auto const& str) {
+        return std::regex_match(str, stl_regex);
+    });
+
+    auto nfa = parser.toNFA();
+    run("NFA", [&](auto const& str) {
+        return nfa.testMatch(str);
+    });
+    auto reduced = nfa.reduce();
+    run("Reduced NFA", [&](auto const& str) {
+        return reduced.testMatch(str);
+    });
+    BitState bitState(nfa);
+    run("BitState", [&](auto const& str) {
+        return bitState.match(str);
+    });
+
+    auto dfa = nfa.lower();
+    run("DFA", [&](auto const& str) {
+        return dfa.testMatch(str);
+    });
+    auto frozenDfa = dfa.freeze();
+    run("Frozen DFA", [&](auto const& str) {
+        return frozenDfa.testMatch(str);
+    });
+
+    JitFunction jfn(dfa);
+    run("JIT", [&](auto const& str) {
+        return jfn(str);
+    });
+
+#ifdef HAVE_RE2
+    RE2 re2(pattern);
+    assert(re2.ok());
+    run("RE2", [&](auto const& str) {
+        return RE2::FullMatch(str, re2);
+    });
+#endif
+
+#ifdef HAVE_PCRE2
+    int error;
+    PCRE2_SIZE offset;
+    auto code = pcre2_compile((PCRE2_SPTR)pattern.c_str(), PCRE2_ZERO_TERMINATED,
+        PCRE2_ANCHORED | PCRE2_ENDANCHORED, &error, &offset, nullptr);
+    if (!code) {
+        PCRE2_UCHAR message[256];
+        pcre2_get_error_message(error, message, sizeof(message));
+        printf("PCRE2 baseline skipped: %s at offset %zu\n", (char const*)message, size_t(offset));
+    } else {
+        // without JIT support pcre2_jit_match() can't be used; time the interpreter instead
+        bool jitted = pcre2_jit_compile(code, PCRE2_JIT_COMPLETE) == 0;
+        auto matchData = pcre2_match_data_create_from_pattern(code, nullptr);
+        run(jitted ? "PCRE2 JIT" : "PCRE2 (interpreter, JIT unavailable)", [&](auto const& str) {
+            if (jitted) {
+                return pcre2_jit_match(code, (PCRE2_SPTR)str.data(), str.size(), 0, 0, matchData, nullptr) >= 0;
+            }
+            return pcre2_match(code, (PCRE2_SPTR)str.data(), str.size(), 0, 0, matchData, nullptr) >= 0;
+        });
+        pcre2_match_data_free(matchData);
+        pcre2_code_free(code);
+    }
+#endif
+
+#ifdef HAVE_HYPERSCAN
+    hs_database_t* db = nullptr;
+    hs_compile_error_t* compileError = nullptr;
+    hs_scratch_t* scratch = nullptr;
+    auto anchored = "^(?:" + pattern + ")$";
+    if (hs_compile(anchored.c_str(), HS_FLAG_SINGLEMATCH, HS_MODE_BLOCK, nullptr, &db, &compileError) != HS_SUCCESS) {
+        printf("Hyperscan baseline skipped: %s\n", compileError ? compileError->message : "unknown error");
+        hs_free_compile_error(compileError);
+    } else if (hs_error_t err = hs_alloc_scratch(db, &scratch); err != HS_SUCCESS) {
+        printf("Hyperscan baseline skipped: unable to allocate scratch (error %d)\n", int(err));
+        hs_free_database(db);
+    } else {
+        run("Hyperscan", [&](auto const& str) {
+            bool matched = false;
+            hs_scan(db, str.data(), str.size(), 0, scratch, [](unsigned, unsigned long long, unsigned long long, unsigned, void* ctx) {
+                *static_cast<bool*>(ctx) = true;
+                return 1;
+            }, &matched);
+            return matched;
+        });
+        hs_free_scratch(scratch);
+        hs_free_database(db);
+    }
+#endif
+
+    bool agree = true;
+    for (auto& [name, count] : counts) {
+        std::cout << "    " << name << ": " << count << std::endl;
+        agree = agree && count == counts.front().second;
+    }
+    return agree;
+}
+
+bool baselineTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Baseline Tests" << std::endl;
+
+    auto ab = Or(Char('a'), Char('b'));
+    return runBaselines(And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')), {
+            "aa", "aba", "abba", "abbba", "abbbba", "abbbbbbbbbbbbbbbbbbbba", "abbbbbbbbbbbbbbbbbba",
+            "blah blah blah", "abaracadabara", "crapola"
+        })
+        && runBaselines(And(OneOrMore(ab), And(Char('a'), And(ab, ab))), {
+            "aaaa", "abab", "babba", "bbbbbbbbbbbbbbbbbbbbbbbbabb", "aabbaabbaabbaabbaabbaaba",
+            "abc", "blah blah blah", "ab"
+        });
+}
+
+bool statsTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Stats Tests" << std::endl;
+
+    // the histogram buckets are ordered and each floor falls in its own bucket
+    for (uint64_t ns : {0, 1, 3, 4, 5, 7, 8, 100, 1000, 123456789}) {
+        auto b = PatternStats::bucket(ns);
+        assert(PatternStats::bucketFloor(b) <= ns);
+        assert(PatternStats::bucket(PatternStats::bucketFloor(b)) == b);
+        assert(b + 1 == PatternStats::kBuckets || PatternStats::bucketFloor(b + 1) > ns);
+    }
+
+    Benchmark benchmark({
+        "aa", "aba", "abba", "abbba", "abbbba", "abbbbbbbbbbbbbbbbbbbba",
+        "blah blah blah", "abaracadabara", "crapola"
+    });
+
+    StatsRegistry registry;
+    auto ab = Or(Char('a'), Char('b'));
+    Matcher cheap = Matcher::compile(And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')));
+    Matcher pricey = Matcher::compile(And(OneOrMore(ab), And(Char('a'), And(ab, ab))));
+    Matcher jitted = Matcher::compile(And(Char('a'), OneOrMore(Char('b'))));
+    cheap.enableStats(registry, "a(bb)+a");
+    pricey.enableStats(registry, "(a|b)+a(a|b)(a|b)");
+    jitted.enableStats(registry, "ab+");
+    pricey.setEngine(Engine::NFA);
+    jitted.setEngine(Engine::JIT);
+
+    std::cout << "Matchers with stats" << std::endl;
+    benchmark([&](auto const& str) {
+        return cheap(str) + pricey(str) + jitted(str);
+    });
+
+    auto top = registry.top(2);
+    for (auto& row : top) {
+        row.print(std::cout);
+    }
+
+    assert(top.size() == 2);
+    // set to NFA, but inputs this short all go to BitState
+    assert(top[0].name == "(a|b)+a(a|b)(a|b)" && top[0].engine == Engine::BitState);
+    assert(top[0].path.engine == Engine::BitState && top[0].path.tier == int(kernels().tier));
+    assert(registry.stats("(a|b)+a(a|b)(a|b)").engineCalls(Engine::NFA) == 0);
+    assert(top[0].calls == benchmark.tests.size());
+    assert(top[0].estimatedNs >= top[1].estimatedNs);
+    assert(top[0].p50Ns <= top[0].p99Ns);
+    assert(registry.top(10).size() == 3);
+    assert(registry.stats("ab+").engineCalls(Engine::JIT) == benchmark.tests.size());
+    assert(registry.stats("ab+").pathCalls({Engine::JIT, int(JitMode::PerByte)}) == benchmark.tests.size());
+    assert(registry.stats("a(bb)+a").engineCalls(Engine::DFA) == benchmark.tests.size());
+
+    // the DFA engine's short verifier is counted as what ran
+    Matcher pair = Matcher::compile(And(Char('a'), Char('b')));
+    pair.enableStats(registry, "ab");
+    assert(pair("ab") && !pair("abc"));
+    assert(pair.engine() == Engine::DFA && pair.engineFor(2) == Engine::ShortVerifier);
+    assert(registry.stats("ab").pathCalls({Engine::ShortVerifier, int(kernels().tier)}) == 2);
+
+    // sampled time times calls overflows 64 bits; the estimate itself doesn't
+    PatternStats busy;
+    for (int i = 0; i < 1000; ++i) {
+        if (busy.shouldSample()) {
+            busy.recordSample(uint64_t(1) << 54);
+        }
+    }
+    assert(busy.calls() == 1000);
+    assert(busy.estimatedNs() == (uint64_t(1) << 54) * 1000);
+
+    return true;
+}
+
+bool plannerTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Planner Tests" << std::endl;
+
+    auto ab = Or(Char('a'), Char('b'));
+    // expensive and usually true
+    Matcher pricey = Matcher::compile(And(OneOrMore(ab), And(Char('a'), And(ab, ab))));
+    pricey.setEngine(Engine::NFA);
+    // cheap and usually false
+    Matcher cheap = Matcher::compile(And(Char('b'), OneOrMore(ab)));
+    Matcher other = Matcher::compile(And(Char('a'), OneOrMore(ab)));
+
+    // written in the worst order: the expensive pattern first
+    auto filter = (Predicate::leaf(pricey) && Predicate::leaf(cheap)) || !Predicate::leaf(other);
+
+    srand(0);
+    std::vector<std::string> records;
+    for (int i = 0; i < 20000; ++i) {
+        std::string record = i % 10 ? "a" : "b";
+        for (int len = 8 + rand() % 16; len; --len) {
+            record.push_back(rand() % 3 ? 'a' : 'b');
+        }
+        records.push_back(record);
+    }
+
+    PredicatePlanner planner(filter, /*replanEvery*/1024);
+    std::cout << "initial plan: " << planner.explain() << std::endl;
+
+    int matched = 0;
+    for (auto& record : records) {
+        bool expected = (pricey(record) && cheap(record)) || !other(record);
+        bool got = planner(record);
+        assert(got == expected);
+        matched += got;
     }
+    std::cout << "final plan: " << planner.explain() << " matched " << matched << " of " << records.size() << std::endl;
+    std::cout << "expensive pattern ran " << planner.evaluations(pricey) << " times" << std::endl;
+
+    // the cheap, selective pattern now guards the expensive one
+    assert(planner.explain() == "(!L2 || (L1 && L0))");
+    assert(planner.evaluations(pricey) < records.size() / 4);
+
+    // equal costs: only the sampled selectivities can put the rarely true pattern first
+    PredicatePlanner drift(Predicate::leaf(other) && Predicate::leaf(cheap), /*replanEvery*/1024);
+    assert(drift.explain() == "(L0 && L1)");
+    for (auto& record : records) {
+        drift(record);
+    }
+    std::cout << "equal cost plan: " << drift.explain() << std::endl;
 
-    NFA toNFA() const {
-        NFA nfa;
+    // replanEvery 0 keeps the initial plan until replan() is called
+    PredicatePlanner fixed(Predicate::leaf(other) && Predicate::leaf(cheap), /*replanEvery*/0);
+    for (auto& record : records) {
+        fixed(record);
+    }
+    assert(fixed.explain() == "(L0 && L1)");
+    fixed.replan();
+    assert(fixed.explain() == "(L1 && L0)");
 
-        auto start = nfa.addState();
-        nfa.setStart(start);
+    return drift.explain() == "(L1 && L0)";
+}
 
-        auto matchit = merge(nfa, start, a.toNFA());
+bool wideJitTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Wide Load JIT Tests" << std::endl;
 
-        nfa.addMatch(matchit);
-        nfa.addEdge(start, std::nullopt, matchit);
+    auto dfa = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')).toNFA().lower();
+    JitFunction perByte(dfa);
+    JitFunction wide(dfa, JitMode::WideLoad);
 
-        return nfa;
+    // every length around the 8 byte word boundary, matching or not
+    for (int n = 0; n < 40; ++n) {
+        for (auto str : {"a" + std::string(n, 'b') + "a", "a" + std::string(n, 'b') + "ab", "a" + std::string(n, 'b')}) {
+            assert(wide(str) == perByte(str));
+            assert(wide(str) == dfa.testMatch(str));
+        }
     }
-};
 
-template <typename A>
-struct OneOrMore {
-    OneOrMore(A a) : a(a) {}
-    A a;
+    // bytes that need escaping in a character literal, spanning a word boundary
+    std::string awkward = "'\\\n\"\x80\xff?\x01\x7f'";
+    DFA literal;
+    auto state = literal.addState();
+    literal.setStart(state);
+    for (char c : awkward) {
+        auto to = literal.addState();
+        literal.addEdge(state, c, to);
+        state = to;
+    }
+    literal.addMatch(state);
+    JitFunction awkwardPerByte(literal);
+    JitFunction awkwardWide(literal, JitMode::WideLoad);
+    for (auto str : {awkward, awkward + "'", awkward.substr(1), std::string("'\\\n\"\x80\xfe?\x01\x7f'")}) {
+        assert(awkwardPerByte(str) == literal.testMatch(str) && awkwardWide(str) == literal.testMatch(str));
+    }
+    assert(awkwardWide(awkward));
 
-    std::string toStr() const {
-        return "(" + a.toStr() + ")+";
+    // long inputs are where the wide loads pay off
+    Benchmark benchmark({
+        "a" + std::string(4096, 'b') + "a", "a" + std::string(4094, 'b') + "a",
+        "a" + std::string(4095, 'b') + "a", "a" + std::string(2048, 'b') + "c" + std::string(2047, 'b') + "a"
+    }, /*count*/10000);
+
+    std::cout << "Per byte JIT" << std::endl;
+    int per_byte_count = benchmark([&](auto const& str) {
+        return perByte(str);
+    });
+    std::cout << per_byte_count << std::endl;
+
+    std::cout << "Wide load JIT" << std::endl;
+    int wide_count = benchmark([&](auto const& str) {
+        return wide(str);
+    });
+    std::cout << wide_count << std::endl;
+
+    return wide_count == per_byte_count;
+}
+
+bool hybridJitTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Hybrid JIT Tests" << std::endl;
+
+    // the samples only reach a few of the states of (a|b)+a(a|b)(a|b); the others are
+    // left to the table even with an unlimited budget
+    auto ab = Or(Char('a'), Char('b'));
+    auto dfa = And(OneOrMore(ab), And(Char('a'), And(ab, ab))).toNFA().lower();
+
+    std::vector<std::string> samples = {"bbbbbbbbbbbbbbbbbbbbbbbbbbbb", "bbbbbbbbbbbbbbab", "bbbba"};
+    auto visits = dfa.profile(samples);
+
+    HybridJit all(dfa, visits, /*codeBudget*/1 << 20);
+    HybridJit some(dfa, visits, /*codeBudget*/3 * (HybridJit::kBytesPerState + 2 * HybridJit::kBytesPerEdge));
+    HybridJit none(dfa, visits, /*codeBudget*/0);
+    std::cout << "hot states: " << all.numHot() << ", " << some.numHot() << ", " << none.numHot() << " of " << dfa.numStates() << std::endl;
+    assert(some.numHot() == 3 && none.numHot() == 0);
+    assert(all.numHot() > some.numHot());
+
+    for (int len = 0; len <= 8; ++len) {
+        for (int bits = 0; bits < (1 << len); ++bits) {
+            std::string str;
+            for (int i = 0; i < len; ++i) {
+                str.push_back(bits & (1 << i) ? 'a' : 'b');
+            }
+            bool expected = dfa.testMatch(str);
+            assert(all(str) == expected && some(str) == expected && none(str) == expected);
+        }
+    }
+    assert(!all("abac") && !some("abac") && !none("abac"));
+
+    // labels that need escaping as character literals
+    DFA awkward;
+    auto quote = awkward.addState();
+    auto high = awkward.addState();
+    awkward.setStart(quote);
+    awkward.addEdge(quote, '\'', high);
+    awkward.addEdge(quote, '\\', high);
+    awkward.addEdge(high, '\xff', quote);
+    awkward.addEdge(high, '\n', quote);
+    awkward.addMatch(quote);
+    HybridJit awkwardJit(awkward, awkward.profile({"'\xff\\\n"}), /*codeBudget*/1 << 20);
+    assert(awkwardJit.numHot() == 2);
+    for (std::string str : {"", "'\xff\\\n", "'\n'", "'\xfe", "\\"}) {
+        assert(awkwardJit(str) == awkward.testMatch(str));
     }
 
-    NFA toNFA() const {
-        NFA nfa;
+    Benchmark benchmark({
+        std::string(64, 'b') + "abb", std::string(64, 'b'), std::string(32, 'b') + "aaaa" + std::string(32, 'b'),
+    }, /*count*/100000);
 
-        auto start = nfa.addState();
-        nfa.setStart(start);
+    std::cout << "Table DFA" << std::endl;
+    int table_count = benchmark([&](auto const& str) {
+        return none(str);
+    });
+    std::cout << table_count << std::endl;
 
-        auto matchit = merge(nfa, start, a.toNFA());
+    std::cout << "Hybrid JIT" << std::endl;
+    int hybrid_count = benchmark([&](auto const& str) {
+        return some(str);
+    });
+    std::cout << hybrid_count << std::endl;
 
-        nfa.addMatch(matchit);
-        nfa.addEdge(matchit, std::nullopt, start);
+    return hybrid_count == table_count;
+}
 
-        return nfa;
+bool simdTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "SIMD Dispatch Tests" << std::endl;
+
+    auto detected = detectTier();
+    std::cout << "detected tier: " << tierName(detected) << std::endl;
+    assert(kernels().tier == detected);
+
+    srand(0);
+    std::string data;
+    for (int i = 0; i < 300; ++i) {
+        data.push_back('a' + rand() % 4);
     }
-};
 
-bool basicTests() {
+    // every tier must agree with the scalar kernel at every offset and length
+    bool ok = true;
+    for (int t = 0; t < int(SimdTier::Count); ++t) {
+        auto tier = SimdTier(t);
+        if (!forceTier(tier)) {
+            std::cout << tierName(tier) << ": unsupported" << std::endl;
+            continue;
+        }
+        assert(kernels().tier == tier);
+        for (size_t offset = 0; offset < 70; ++offset) {
+            for (size_t len = 0; offset + len <= data.size(); len += 7) {
+                for (char byte : {'a', 'd', 'z'}) {
+                    ok = ok && kernels().findByte(data.data() + offset, len, byte)
+                        == findByteScalar(data.data() + offset, len, byte);
+                }
+            }
+        }
+        auto records = splitRecords("abba\n\nabbbba\ncrapola");
+        ok = ok && records.size() == 4 && records[0] == "abba" && records[1].empty() && records[3] == "crapola";
+        std::cout << tierName(tier) << ": " << (ok ? "ok" : "MISMATCH") << std::endl;
+    }
+    forceTier(detected);
+    return ok;
+}
+
+bool feasibilityTests() {
     std::cout << "--------------------------" << std::endl;
-    std::cout << "Basic Tests" << std::endl;
+    std::cout << "Feasibility Tests" << std::endl;
+
+    auto dfa = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')).toNFA().lower();
+    FeasibilityFilter feasible(dfa);
+    std::cout << "alphabet: " << feasible.alphabet().size() << " bytes, bigrams: " << feasible.numBigrams() << std::endl;
+    assert(feasible.alphabet().size() == 2 && feasible.numBigrams() == 3); // ab bb ba
+
+    bool ok = true;
+    auto detected = kernels().tier;
+    for (int t = 0; t < int(SimdTier::Count); ++t) {
+        if (!forceTier(SimdTier(t))) {
+            continue;
+        }
+        ok = ok && !feasible("blah blah blah") && !feasible("crapola") && !feasible("abaracadabara");
+        ok = ok && !feasible("aa") && !feasible("abbaab") && feasible("abba") && feasible("abbba") && feasible("");
+        ok = ok && !feasible(std::string(1000, 'b') + "c");
+
+        // every byte value, inside and outside a set, at every position of a vector
+        ByteSet set;
+        for (int c = 0; c < 256; c += 3) {
+            set.insert(c);
+        }
+        for (int c = 0; c < 256; ++c) {
+            for (size_t pos : {0, 15, 31, 63, 64, 100}) {
+                std::string data(101, char(0));
+                data[pos] = char(c);
+                ok = ok && kernels().findNotInSet(data.data(), data.size(), set) == findNotInSetScalar(data.data(), data.size(), set);
+            }
+        }
+        std::cout << tierName(SimdTier(t)) << ": " << (ok ? "ok" : "MISMATCH") << std::endl;
+    }
+    forceTier(detected);
 
+    // the filter only ever rejects, so a DFA behind it gives the same answers
     Benchmark benchmark({
-        "aba", "abb", "aa", "ab", "a",
-        "aaa", "aab", "baa", "bba", "bbb", "ba", "bb", "b", "c",
-        "blah blah blah", "abaracadabara"
+        "aa", "aba", "abba", "abbba", "abbbbbbbbbbbbbbbbbbbba", "abbbbbbbbbbbbbbbbbba",
+        "blah blah blah", "abaracadabara", "crapola", std::string(200, 'x'), "a" + std::string(200, 'b') + "c"
+    });
+    auto frozen = dfa.freeze();
+    std::cout << "Frozen DFA" << std::endl;
+    int dfa_count = benchmark([&](auto const& str) {
+        return frozen.testMatch(str);
+    });
+    std::cout << "Filtered DFA" << std::endl;
+    int filtered_count = benchmark([&](auto const& str) {
+        return feasible(str) && frozen.testMatch(str);
     });
+    assert(dfa_count == filtered_count);
 
-    NFA nfa;
+    auto matcher = Matcher::compile(And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')));
+    ok = ok && matcher("abba") && !matcher("crapola") && !matcher("abbba");
+    return ok;
+}
+
+bool compileCacheTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Compile Cache Tests" << std::endl;
+
+    auto abba = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    auto ab = Or(Char('a'), Char('b'));
+    auto suffix = And(OneOrMore(ab), And(Char('a'), And(ab, ab)));
+
+    // a pattern going live on many threads at once compiles once
+    CompileCache cache;
+    std::vector<std::shared_ptr<Matcher const>> results(8);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < results.size(); ++i) {
+        threads.emplace_back([&, i] {
+            results[i] = cache.get(abba);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto stats = cache.stats();
+    std::cout << "hits: " << stats.hits << ", waits: " << stats.waits << ", misses: " << stats.misses << std::endl;
+    assert(stats.misses == 1 && stats.hits + stats.waits == results.size() - 1);
+    for (auto& result : results) {
+        assert(result == results[0]);
+    }
+    assert((*results[0])("abba") && !(*results[0])("aba"));
+
+    // the engine is part of the key
+    auto bitState = cache.get(abba, Engine::BitState);
+    assert(bitState != results[0] && bitState->engine() == Engine::BitState && cache.size() == 2);
+    assert(cache.bytes() == results[0]->memoryUsage().total() + bitState->memoryUsage().total());
+
+    // a budget of about one entry evicts the least recently used
+    CompileCache small(results[0]->memoryUsage().total() + 1);
+    auto held = small.get(abba);
+    small.get(suffix);
+    assert(small.size() == 1 && small.stats().evictions == 1);
+    assert((*held)("abbbba")); // still alive after eviction
+    assert(small.get(abba) != held && small.stats().misses == 3);
+
+    return &CompileCache::global() == &CompileCache::global();
+}
 
+bool symbolTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Symbol Tests" << std::endl;
+
+    // login (read | write)* logout over 16-bit event ids
+    enum : uint16_t { Login = 1000, Read = 2000, Write = 2001, Logout = 65535, Crash = 7 };
+    BasicNFA<uint16_t> nfa;
+    auto s0 = nfa.addState();
     auto s1 = nfa.addState();
     auto s2 = nfa.addState();
     auto s3 = nfa.addState();
-    auto s4 = nfa.addState();
-    auto s5 = nfa.addState();
-
+    nfa.setStart(s0);
+    nfa.addEdge(s0, Login, s1);
     nfa.addEdge(s1, std::nullopt, s2);
-    nfa.addEdge(s1, 'a', s3);
-    nfa.addEdge(s2, 'a', s4);
-    nfa.addEdge(s2, 'a', s5);
-    nfa.addEdge(s3, 'b', s4);
-    nfa.addEdge(s4, 'a', s5);
-    nfa.addEdge(s4, 'b', s5);
-
-    nfa.setStart(s1);
-    nfa.addMatch(s5);
+    nfa.addEdge(s2, Read, s1);
+    nfa.addEdge(s2, Write, s1);
+    nfa.addEdge(s2, Logout, s3);
+    nfa.addMatch(s3);
+
+    auto dfa = nfa.reduce().lower();
+    DenseDFA<uint16_t> dense(dfa);
+    JitFunction jit(dfa);
+    std::cout << "DFA: " << dfa.numStates() << " states, " << dense.numClasses() << " symbol classes" << std::endl;
+    assert(dense.numClasses() == 4); // other, login, read/write, logout
+
+    std::vector<std::vector<uint16_t>> sessions = {
+        {Login, Logout}, {Login, Read, Write, Read, Logout}, {Login}, {Read, Logout},
+        {Login, Read, Crash, Logout}, {Login, Logout, Logout}, {}
+    };
+    bool ok = true;
+    for (auto& session : sessions) {
+        std::span<uint16_t const> events(session);
+        bool expected = nfa.testMatch(events);
+        ok = ok && dfa.testMatch(events) == expected && dense.testMatch(events) == expected && jit(events) == expected;
+    }
+    ok = ok && nfa.testMatch(std::span<uint16_t const>(sessions[1])) && !nfa.testMatch(std::span<uint16_t const>(sessions[4]));
+
+    // 32-bit token ids go through the sorted class lookup
+    BasicNFA<uint32_t> tokens;
+    auto t0 = tokens.addState();
+    auto t1 = tokens.addState();
+    tokens.setStart(t0);
+    tokens.addEdge(t0, 0xdeadbeef, t1);
+    tokens.addEdge(t1, 0xdeadbeef, t1);
+    tokens.addEdge(t1, 42, t0);
+    tokens.addMatch(t1);
+    auto tokenDfa = tokens.lower();
+    DenseDFA<uint32_t> tokenDense(tokenDfa);
+    JitFunction tokenJit(tokenDfa);
+    std::vector<uint32_t> run = {0xdeadbeef, 42, 0xdeadbeef, 0xdeadbeef};
+    std::vector<uint32_t> bad = {0xdeadbeef, 43};
+    ok = ok && tokenDense.testMatch(run) && tokenJit(std::span<uint32_t const>(run)) && tokenDfa.testMatch(run);
+    ok = ok && !tokenDense.testMatch(bad) && !tokenJit(std::span<uint32_t const>(bad)) && !tokenDfa.testMatch(bad);
+
+    // and bytes still work the same through the dense table
+    auto bytes = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')).toNFA().lower();
+    DenseDFA<char> byteDense(bytes);
+    ok = ok && byteDense.numClasses() == 3 && byteDense.testMatch("abba") && !byteDense.testMatch("abbba") && !byteDense.testMatch("c");
+    std::cout << "dense byte table: " << byteDense.memoryUsage().total() << " bytes" << std::endl;
+    return ok;
+}
 
-    assert(nfa.testMatch("a"));
-    assert(nfa.testMatch("ab"));
-    assert(nfa.testMatch("abb"));
-    assert(!nfa.testMatch("c"));
-    assert(!nfa.testMatch("abbb"));
+bool autotunerTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Autotuner Tests" << std::endl;
 
-    std::cout << "NFA" << std::endl;
-    nfa.print();
-    int nfa_count = benchmark([&](auto const& str) {
-        return nfa.testMatch(str);
-    });
-    std::cout << nfa_count << std::endl;
+    auto abba = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    auto ab = Or(Char('a'), Char('b'));
+    auto suffix = And(OneOrMore(ab), And(Char('a'), And(ab, ab)));
 
-    DFA dfa = nfa.lower();
+    std::vector<std::string> corpus;
+    for (int i = 0; i < 200; ++i) {
+        corpus.push_back(i % 2 ? "a" + std::string(i, 'b') + "a" : "blah blah blah");
+    }
 
-    assert(dfa.testMatch("a"));
-    assert(dfa.testMatch("ab"));
-    assert(dfa.testMatch("abb"));
-    assert(!dfa.testMatch("c"));
-    assert(!dfa.testMatch("abbb"));
+    std::string path = "tuning" + std::to_string(getpid()) + ".profile";
+    Autotuner tuner(corpus, /*rounds*/2);
+    tuner.add(abba);
+    tuner.add(suffix);
+    tuner.start(path);
+    auto profile = tuner.sync();
+    assert(profile && profile->choices.size() == 2);
+    for (auto& [pattern, choice] : profile->choices) {
+        std::cout << pattern << ": " << engineName(choice.engine) << (choice.engine == Engine::JIT && choice.jitMode == JitMode::WideLoad ? " (wide)" : "")
+                  << (choice.filter ? " + filter" : "") << ", " << choice.nsPerByte << "ns/byte" << std::endl;
+        assert(choice.nsPerByte > 0);
+    }
 
-    std::cout << "DFA" << std::endl;
-    dfa.print();
-    int dfa_count = benchmark([&](auto const& str) {
-        return dfa.testMatch(str);
-    });
-    std::cout << dfa_count << std::endl;
+    // what the background thread saved loads back, and the matcher picks it up
+    auto loaded = TuningProfile::load(path);
+    assert(loaded && loaded->choices.size() == 2);
+    auto choice = *loaded->find(abba.toStr());
+    assert(choice.engine == profile->find(abba.toStr())->engine && choice.filter == profile->find(abba.toStr())->filter);
+    auto matcher = Matcher::compile(abba, *loaded);
+    assert(matcher.engine() == choice.engine && matcher("abbbba") && !matcher("abba a"));
+    assert(Matcher::compile(And(Char('x'), Char('y')), *loaded).engine() == Engine::DFA);
+
+    // a new corpus triggers a re-tune
+    tuner.setCorpus({"abbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbba", "crapola"});
+    auto retuned = tuner.sync();
+    assert(retuned != profile && retuned->choices.size() == 2);
+    tuner.stop();
+
+    // profiles from other hosts are ignored
+    TuningProfile other = *loaded;
+    other.host = "elsewhere";
+    other.save(path);
+    assert(!TuningProfile::load(path));
+
+    // entries with an out of range JIT mode are dropped, the rest still load
+    {
+        std::ofstream out(path);
+        out << "tuning-profile 1 " << std::quoted(TuningProfile::currentHost()) << std::endl
+            << "JIT 7 1 0.5 \"bad\"" << std::endl
+            << "JIT -1 1 0.5 \"negative\"" << std::endl
+            << "JIT 1 0 0.25 \"good\"" << std::endl;
+    }
+    auto partial = TuningProfile::load(path);
+    assert(partial && partial->choices.size() == 1 && !partial->find("bad") && !partial->find("negative"));
+    assert(partial->find("good")->jitMode == JitMode::WideLoad);
+    std::remove(path.c_str());
+    return true;
+}
 
-    JitFunction jfn(dfa);
+bool shortVerifierTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Short Verifier Tests" << std::endl;
 
-    assert(jfn("a"));
-    assert(jfn("ab"));
-    assert(jfn("abb"));
-    assert(!jfn("c"));
-    assert(!jfn("abbb"));
+    // alternatives of fixed sequences of byte classes
+    auto classes = [](std::vector<std::vector<std::string>> const& alternatives) {
+        NFA nfa;
+        auto start = nfa.addState();
+        nfa.setStart(start);
+        for (auto& alternative : alternatives) {
+            auto state = nfa.addState();
+            nfa.addEdge(start, std::nullopt, state);
+            for (auto& cls : alternative) {
+                auto next = nfa.addState();
+                for (char c : cls) {
+                    nfa.addEdge(state, c, next);
+                }
+                state = next;
+            }
+            nfa.addMatch(state);
+        }
+        return nfa.lower();
+    };
+
+    std::string const d = "0123456789";
+    std::string const hex = d + "abcdefABCDEF";
+    auto octet = classes({{"2", "5", "012345"}, {"2", "01234", d}, {"1", d, d}, {"123456789", d}, {d}});
+    auto time = classes({{"01", d, ":", "012345", d}, {"2", "0123", ":", "012345", d}});
+    auto status = classes({{"12345", d, d}});
+    auto id = classes({std::vector<std::string>(8, hex), std::vector<std::string>(16, hex)});
+    auto wide = classes({std::vector<std::string>(32, "ab"), std::vector<std::string>(20, "ab")});
+
+    assert(!ShortVerifier::compile(And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')).toNFA().lower()));
+    assert(!ShortVerifier::compile(classes({std::vector<std::string>(33, d)})));
+
+    bool ok = true;
+    srand(0);
+    auto detected = kernels().tier;
+    for (auto* dfa : {&octet, &time, &status, &id, &wide}) {
+        auto verifier = ShortVerifier::compile(*dfa);
+        assert(verifier);
+        std::cout << verifier->numShapes() << " shapes, up to " << verifier->maxLength() << " bytes" << std::endl;
+
+        std::vector<std::string> samples = {"", "0", "255", "256", "23:59", "24:00", "404", "600", "deadBEEF", "deadBEEG",
+            std::string(32, 'a'), std::string(33, 'a'), std::string(20, 'b'), std::string(21, 'b')};
+        for (int i = 0; i < 2000; ++i) {
+            std::string sample(rand() % 34, ' ');
+            for (auto& c : sample) {
+                c = "0123456789:abAB\xff"[rand() % 16];
+            }
+            samples.push_back(sample);
+        }
+        for (int t = 0; t < int(SimdTier::Count); ++t) {
+            if (!forceTier(SimdTier(t))) {
+                continue;
+            }
+            for (auto& sample : samples) {
+                ok = ok && verifier->match(sample) == dfa->testMatch(sample);
+            }
+        }
+        forceTier(detected);
+    }
+    std::cout << (ok ? "all tiers agree with the DFA" : "MISMATCH") << std::endl;
 
-    std::cout << "JIT" << std::endl;
-    int jit_count = benchmark([&](auto const& str) {
-        return jfn(str);
+    Benchmark benchmark({"0", "9", "10", "99", "100", "199", "200", "249", "250", "255", "256", "300", "1000", "-1", "01"});
+    auto frozen = octet.freeze();
+    auto verifier = *ShortVerifier::compile(octet);
+    std::cout << "Frozen DFA" << std::endl;
+    int dfa_count = benchmark([&](auto const& str) {
+        return frozen.testMatch(str);
     });
-    std::cout << jit_count << std::endl;
-
-    return jit_count == dfa_count && dfa_count == nfa_count;
+    std::cout << "Short verifier" << std::endl;
+    int verifier_count = benchmark([&](auto const& str) {
+        return verifier.match(str);
+    });
+    return ok && dfa_count == verifier_count;
 }
 
-bool regexTests() {
-    // a(bb)+a (the same example as the article linked at the top of this file)
+bool traceTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Trace Tests" << std::endl;
+
+    auto abba = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    auto& tracer = Tracer::global();
+    assert(!tracer.enabled());
+    Matcher::compile(abba);
+    tracer.start();
+    assert(tracer.numEvents() == 0);
+
+    {
+        TraceScope pipeline("compile pattern set");
+        auto matcher = Matcher::compile(abba);
+        matcher.setEngine(Engine::JIT);
+        abba.toNFA().reduce();
+        std::thread worker([&] {
+            Matcher::compile(abba);
+        });
+        worker.join();
+        TrigramIndex index({"abba", "abbbba", "crapola"});
+        index.search(abba.trigrams().query(), [&](auto const& doc) {
+            return matcher(doc);
+        });
+    }
+    tracer.stop();
+    auto events = tracer.numEvents();
+    Matcher::compile(abba);
+    assert(tracer.numEvents() == events);
+
+    std::stringstream json;
+    tracer.writeJson(json);
+    auto text = json.str();
+    std::cout << events << " events, " << text.size() << " bytes of JSON" << std::endl;
+    for (auto name : {"compile pattern set", "toNFA", "merge", "lower", "freeze", "reduce", "jit", "jit.emit", "jit.compile",
+                      "feasibility", "shortVerifier", "trigram.candidates", "trigram.verify"}) {
+        assert(text.find("\"name\":\"" + std::string(name) + "\"") != std::string::npos);
+    }
+    // the worker thread got its own track
+    return text.find("\"tid\":2") != std::string::npos && text.rfind("]", text.size()) != std::string::npos;
+}
 
+bool shardTests() {
     std::cout << "--------------------------" << std::endl;
-    std::cout << "Regex Tests" << std::endl;
-    
-    Benchmark benchmark({
-        "aa", "aba", "abba", "abbba", "abbbba", "abbbbbbbbbbbbbbbbbbbba", "abbbbbbbbbbbbbbbbbba"
-        "blah blah blah", "abaracadabara", "crapola"
-    });
+    std::cout << "Sharded Scan Tests" << std::endl;
+
+    auto abba = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    auto dfa = abba.toNFA().lower().freeze();
+
+    srand(0);
+    char const* words[] = {"abba", "abbbba", "abbba", "crapola", "", "aa"};
+    std::vector<std::string> paths;
+    std::vector<std::string> contents;
+    for (int file = 0; file < 3; ++file) {
+        std::string text;
+        // the last file is empty, the second has no trailing delimiter
+        int lines = file == 2 ? 0 : 20000 + file * 777;
+        for (int i = 0; i < lines; ++i) {
+            text += words[rand() % 6];
+            if (i + 1 < lines || file == 0) {
+                text += '\n';
+            }
+        }
+        paths.push_back("shard" + std::to_string(getpid()) + "_" + std::to_string(file) + ".txt");
+        std::ofstream(paths.back(), std::ios::binary) << text;
+        contents.push_back(text);
+    }
 
-    auto parser = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    ShardedScanResult expected;
+    expected.offsets.resize(paths.size());
+    for (size_t file = 0; file < contents.size(); ++file) {
+        for (auto record : splitRecords(contents[file])) {
+            ++expected.records;
+            if (dfa.testMatch(record)) {
+                ++expected.matches;
+                expected.offsets[file].push_back(record.data() - contents[file].data());
+            }
+        }
+    }
+    std::cout << expected.records << " records, " << expected.matches << " matches" << std::endl;
+
+    ShardedScan::Options options;
+    options.workers = 3;
+    options.offsets = true;
+    // small enough that workers have to wait for the coordinator
+    options.ringSlots = 64;
+
+    // shards cover each file exactly and end on record boundaries
+    ShardedScan scan(dfa, paths, options);
+    auto shards = scan.plan(12);
+    for (size_t file = 0; file < paths.size(); ++file) {
+        size_t pos = 0;
+        for (auto& shard : shards) {
+            if (shard.file == file) {
+                assert(shard.begin == pos && shard.end > shard.begin);
+                assert(shard.end == contents[file].size() || contents[file][shard.end - 1] == '\n');
+                pos = shard.end;
+            }
+        }
+        assert(pos == contents[file].size());
+    }
 
-    auto str = parser.toStr();
-    std::cout << "Regex as string: " << str << std::endl;
+    for (bool local : {false, true}) {
+        options.local = local;
+        ShardedScan scan(dfa, paths, options);
+        auto result = scan.run();
+        std::cout << (local ? "local: " : "forked: ") << result.records << " records, " << result.matches << " matches" << std::endl;
+        assert(result.records == expected.records && result.matches == expected.matches);
+        assert(result.offsets == expected.offsets);
+    }
 
-    const std::regex stl_regex(str);
-    
-    int stl_count = benchmark([&](auto const& str) {
-        return std::regex_match(str, stl_regex);
-    });
-    std::cout << stl_count << std::endl;
+    options.offsets = false;
+    options.workers = 1;
+    auto counts = ShardedScan(dfa, paths, options).run();
+    assert(counts.matches == expected.matches);
+    assert(counts.offsets[0].empty() && counts.offsets[1].empty());
 
-    auto nfa = parser.toNFA();
+    for (auto& path : paths) {
+        std::remove(path.c_str());
+    }
+    return true;
+}
 
-    assert(!nfa.testMatch("aa"));
-    assert(!nfa.testMatch("aba"));
-    assert(nfa.testMatch("abba"));
-    assert(!nfa.testMatch("abbba"));
-    assert(nfa.testMatch("abbbba"));
+bool dispatchTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Dispatch Index Tests" << std::endl;
+
+    // thousands of literals plus a few unbounded patterns and one that accepts ""
+    srand(0);
+    std::vector<FrozenDFA> dfas;
+    std::vector<std::string> literals;
+    for (int i = 0; i < 3000; ++i) {
+        std::string literal;
+        int length = 2 + rand() % 12;
+        for (int j = 0; j < length; ++j) {
+            literal += char('a' + rand() % 6);
+        }
+        DFA dfa;
+        auto state = dfa.addState();
+        dfa.setStart(state);
+        for (char c : literal) {
+            auto to = dfa.addState();
+            dfa.addEdge(state, c, to);
+            state = to;
+        }
+        dfa.addMatch(state);
+        dfas.push_back(dfa.freeze());
+        literals.push_back(literal);
+    }
+    auto abba = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    auto ab = Or(Char('a'), Char('b'));
+    dfas.push_back(abba.toNFA().lower().freeze());
+    dfas.push_back(And(OneOrMore(ab), And(Char('a'), And(ab, ab))).toNFA().lower().freeze());
+    dfas.push_back(Maybe(Char('f')).toNFA().lower().freeze());
+
+    DispatchIndex index(dfas);
+    assert(index.numPatterns() == dfas.size());
+    std::cout << "memory: " << index.memoryUsage().total() << " bytes" << std::endl;
+
+    std::vector<std::string> inputs = {"", "f", "abba", "abbbba", std::string(200, 'a') + "bab"};
+    inputs.push_back("a" + std::string(100, 'b') + "a");
+    for (int i = 0; i < 2000; ++i) {
+        inputs.push_back(i % 2 ? literals[rand() % literals.size()] : literals[rand() % literals.size()] + "a");
+    }
 
-    std::cout << "Regex as NFA:" << std::endl;
-    // You can see in this printout that this NFA has a lot of unnecessary epsilon transitions
-    nfa.print();
-    int nfa_count = benchmark([&](auto const& str) {
-        return nfa.testMatch(str);
-    });
-    std::cout << nfa_count << std::endl;
+    size_t candidates = 0;
+    for (auto& input : inputs) {
+        std::vector<DispatchIndex::PatternId> expected;
+        for (DispatchIndex::PatternId id = 0; id < dfas.size(); ++id) {
+            if (dfas[id].testMatch(input)) {
+                expected.push_back(id);
+            }
+        }
+        auto found = index.search(input, [&](DispatchIndex::PatternId id, std::string_view sv) {
+            return dfas[id].testMatch(sv);
+        });
+        assert(found == expected);
+        candidates += index.candidates(input).size();
+    }
+    double perInput = double(candidates) / inputs.size();
+    std::cout << perInput << " candidates per input out of " << dfas.size() << " patterns" << std::endl;
+    assert(perInput < dfas.size() / 20);
+
+    assert(index.candidates("") == std::vector<DispatchIndex::PatternId>{DispatchIndex::PatternId(dfas.size() - 1)});
+    auto longAbba = index.candidates("a" + std::string(100, 'b') + "a");
+    assert(std::find(longAbba.begin(), longAbba.end(), 3000) != longAbba.end());
+    return true;
+}
 
-    auto dfa = nfa.lower();
+bool bulkCompileTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Bulk Compile Tests" << std::endl;
 
-    assert(!dfa.testMatch("aa"));
-    assert(!dfa.testMatch("aba"));
-    assert(dfa.testMatch("abba"));
-    assert(!dfa.testMatch("abbba"));
-    assert(dfa.testMatch("abbbba"));
+    auto abba = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a'));
+    auto ab = Or(Char('a'), Char('b'));
+    auto fill = [&](BulkCompiler& compiler) {
+        srand(0);
+        compiler.add(abba);
+        for (int i = 0; i < 400; ++i) {
+            std::string literal;
+            int length = 1 + rand() % 40;
+            for (int j = 0; j < length; ++j) {
+                literal += char('a' + rand() % 26);
+            }
+            compiler.add(literal, [literal]() {
+                NFA nfa;
+                auto state = nfa.addState();
+                nfa.setStart(state);
+                for (char c : literal) {
+                    auto to = nfa.addState();
+                    nfa.addEdge(state, c, to);
+                    state = to;
+                }
+                nfa.addMatch(state);
+                return nfa;
+            });
+        }
+        compiler.add("broken", []() -> NFA {
+            throw std::runtime_error("unsupported construct");
+        });
+        compiler.add(And(OneOrMore(ab), And(Char('a'), And(ab, ab))));
+    };
+
+    std::vector<std::chrono::nanoseconds> walls;
+    for (size_t threads : {1, 4}) {
+        BulkCompiler::Options options;
+        options.threads = threads;
+        // small enough that the budget holds back some starts
+        options.memoryBudget = 64 << 10;
+        BulkCompiler compiler(options);
+        fill(compiler);
+
+        auto start = std::chrono::steady_clock::now();
+        auto results = compiler.compile();
+        walls.push_back(std::chrono::steady_clock::now() - start);
+        std::cout << threads << " threads: " << std::chrono::duration_cast<std::chrono::microseconds>(walls.back()).count()
+                  << "us, peak in flight " << compiler.peakInFlight() << " bytes" << std::endl;
+
+        assert(results.size() == 403);
+        assert(results[0].name == abba.toStr() && results[0].matcher);
+        assert((*results[0].matcher)("abbbba") && !(*results[0].matcher)("abbba"));
+        for (size_t i = 1; i <= 400; ++i) {
+            auto& result = results[i];
+            assert(result.matcher && result.error.empty() && result.bytes > 0);
+            assert((*result.matcher)(result.name) && !(*result.matcher)(result.name + "a"));
+        }
+        assert(!results[401].matcher && results[401].error == "unsupported construct");
+        assert(results[402].matcher && (*results[402].matcher)("bbbabb"));
+    }
 
+    BulkCompiler::Options serial;
+    serial.threads = 0;
+    BulkCompiler fallback(serial);
+    fallback.add(abba);
+    auto compiled = fallback.compile();
+    assert(compiled.size() == 1 && compiled[0].matcher && compiled[0].error.empty());
+
+    BulkCompiler::Options options;
+    options.threads = 2;
+    options.engine = Engine::JIT;
+    BulkCompiler jit(options);
+    jit.add(abba);
+    jit.add(And(OneOrMore(ab), And(Char('a'), And(ab, ab))));
+    auto results = jit.compile();
+    for (auto& result : results) {
+        assert(result.matcher && result.matcher->engine() == Engine::JIT && result.jit.count() > 0);
+    }
+    assert((*results[0].matcher)("abba") && (*results[1].matcher)("bbbabb"));
+    return true;
+}
 
-    std::cout << "Regex as DFA:" << std::endl;
-    dfa.print();
-    int dfa_count = benchmark([&](auto const& str) {
-        return dfa.testMatch(str);
-    });
-    
-    JitFunction jfn(dfa);
+bool incrementalTests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "Incremental Tests" << std::endl;
+
+    auto dfa = And(And(Char('a') , OneOrMore(And(Char('b'), Char('b')))), Char('a')).toNFA().lower();
+    std::string doc = "a" + std::string(1 << 16, 'b') + "a";
+    IncrementalScanner scanner(dfa.freeze(), doc, /*interval*/64);
+    assert(scanner.matches() && scanner.lastRescanned() == doc.size());
+
+    // keeps the parity of the b's, so the states line up again right after the edit
+    scanner.edit(1000, 0, "bb");
+    std::cout << "insert bb: rescanned " << scanner.lastRescanned() << " bytes" << std::endl;
+    assert(scanner.matches() && scanner.lastRescanned() <= 2 * 64 + 2);
+
+    scanner.edit(5000, 4, "");
+    std::cout << "delete bbbb: rescanned " << scanner.lastRescanned() << " bytes" << std::endl;
+    assert(scanner.matches() && scanner.lastRescanned() <= 2 * 64);
+
+    // flips the parity: no convergence, everything after the edit is rescanned
+    scanner.edit(30000, 0, "b");
+    std::cout << "insert b: rescanned " << scanner.lastRescanned() << " bytes" << std::endl;
+    assert(!scanner.matches() && scanner.lastRescanned() > scanner.text().size() - 30000);
+
+    // checkpoints now hold the flipped states, so parity-preserving edits converge again
+    scanner.edit(40000, 2, "bbbb");
+    std::cout << "insert bb: rescanned " << scanner.lastRescanned() << " bytes" << std::endl;
+    assert(!scanner.matches() && scanner.lastRescanned() <= 2 * 64 + 4);
+
+    // random edits agree with a full rescan
+    srand(0);
+    for (int i = 0; i < 300; ++i) {
+        auto& text = scanner.text();
+        size_t pos = 1 + rand() % (text.size() - 2);
+        size_t removed = std::min<size_t>(rand() % 4, text.size() - 1 - pos);
+        std::string inserted(rand() % 4, "bbbc"[rand() % 4]);
+        scanner.edit(pos, removed, inserted);
+        assert(scanner.matches() == dfa.testMatch(scanner.text()));
+    }
+    std::cout << "checkpoints: " << scanner.numCheckpoints() << std::endl;
+    return scanner.numCheckpoints() < 4 * scanner.text().size() / 64;
+}
 
+bool lz4Tests() {
+    std::cout << "--------------------------" << std::endl;
+    std::cout << "LZ4 Tests" << std::endl;
+
+    // hand-assembled blocks; `text` tracks what they decompress to.  Every sequence but the
+    // last must have a match.
+    std::string block, text;
+    auto sequence = [&](std::string_view literals, size_t offset = 0, size_t matchLength = 0) {
+        auto extend = [&](size_t n) {
+            if (n >= 15) {
+                for (n -= 15; n >= 255; n -= 255) {
+                    block.push_back(char(255));
+                }
+                block.push_back(char(n));
+            }
+        };
+        size_t const code = matchLength ? matchLength - 4 : 0;
+        block.push_back(char(std::min<size_t>(literals.size(), 15) << 4 | std::min<size_t>(code, 15)));
+        extend(literals.size());
+        block.append(literals);
+        text.append(literals);
+        if (matchLength) {
+            block.push_back(char(offset & 0xff));
+            block.push_back(char(offset >> 8));
+            extend(code);
+            for (size_t k = 0, src = text.size() - offset; k < matchLength; ++k) {
+                text.push_back(text[src + k]);
+            }
+        }
+    };
 
-    assert(!jfn("aa"));
-    assert(!jfn("aba"));
-    assert(jfn("abba"));
-    assert(!jfn("abbba"));
-    assert(jfn("abbbba"));
+    // (ab|ba)+c
+    auto dfa = And(OneOrMore(Or(And(Char('a'), Char('b')), And(Char('b'), Char('a')))), Char('c')).toNFA().lower();
 
-    std::cout << "JIT" << std::endl;
-    int jit_count = benchmark([&](auto const& str) {
-        return jfn(str);
-    });
-    std::cout << jit_count << std::endl;
+    // a short literal, an overlapping copy, doubling copies, then many copies of one window
+    sequence("abba", 4, 60);
+    while (text.size() < 32768) {
+        sequence("", text.size(), std::min<size_t>(text.size(), 32768 - text.size()));
+    }
+    for (int i = 0; i < 32; ++i) {
+        sequence("", 32768, 32768);
+    }
+    sequence("c");
+
+    LZ4Scanner scanner(dfa.freeze());
+    assert(scanner.testMatch(block) == dfa.testMatch(text));
+    assert(scanner.testMatch(block));
+    auto stats = scanner.stats();
+    std::cout << text.size() << " bytes: " << stats.stepped << " stepped, " << stats.composed << " composed, " << stats.maps << " maps" << std::endl;
+    assert(stats.stepped < text.size() / 10);
+
+    // without maps every byte is stepped
+    LZ4Scanner noMaps(dfa.freeze(), /*mapBudget*/0);
+    assert(noMaps.testMatch(block) && noMaps.stats().stepped == text.size() && !noMaps.stats().composed);
+
+    // nor when the DFA has more states than a piece has bytes: building the map would cost
+    // more than stepping.  Padding the DFA with unreachable states makes it that big.
+    auto big = dfa;
+    while (big.numStates() < 40000) {
+        big.addState();
+    }
+    LZ4Scanner bigScanner(big.freeze());
+    assert(bigScanner.testMatch(block) && bigScanner.stats().maps < stats.maps);
+    assert(bigScanner.stats().stepped <= text.size());
+
+    // odd offsets break the pairing and copies straddle pieces
+    block.clear();
+    text.clear();
+    sequence("abbaab", 6, 6);
+    for (size_t offset : {3, 5, 6, 17, 40, 6, 100}) {
+        sequence("ba", offset, offset + 20);
+    }
+    sequence("c");
+    assert(scanner.testMatch(block) == dfa.testMatch(text));
+
+    block.clear();
+    text.clear();
+    sequence("abab", 4, 4);
+    for (size_t offset : {8, 16, 32, 64, 32, 64, 128}) {
+        sequence("", offset, offset);
+    }
+    sequence("bac");
+    assert(scanner.testMatch(block) && dfa.testMatch(text));
+    assert(!scanner.malformed());
+
+    // malformed blocks are rejected rather than read past
+    std::string good = block;
+    std::vector<std::string> malformed = {
+        good.substr(0, 3),                         // literals cut short
+        good.substr(0, 6),                         // half an offset
+        std::string("\x4f" "abab" "\x04\x00", 7), // match length byte missing
+        std::string("\x40" "abab" "\x00\x00", 7), // zero offset
+        std::string("\x40" "abab" "\x05\x00", 7), // offset before the output
+        std::string("\xf0"),                      // literal length byte missing
+    };
+    for (auto& bad : malformed) {
+        assert(!scanner.testMatch(bad) && scanner.malformed());
+    }
+    assert(scanner.testMatch(good) && !scanner.malformed());
 
-    return jit_count == dfa_count && dfa_count == nfa_count && nfa_count == stl_count;
+    return true;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    if (argc == 3 && std::string(argv[1]) == "--serve") {
+        PatternServer server(argv[2]);
+        addBuiltinPatterns(server);
+        server.serve();
+        return 0;
+    }
+
     assert(basicTests());
     assert(regexTests());
+    assert(frozenTests());
+    assert(memoryTests());
+    assert(reduceTests());
+    assert(offlineTests());
+    assert(budgetTests());
+    assert(serverTests());
+    assert(trigramTests());
+    assert(bitStateTests());
+    assert(baselineTests());
+    assert(statsTests());
+    assert(plannerTests());
+    assert(wideJitTests());
+    assert(hybridJitTests());
+    assert(simdTests());
+    assert(incrementalTests());
+    assert(lz4Tests());
+    assert(feasibilityTests());
+    assert(compileCacheTests());
+    assert(symbolTests());
+    assert(autotunerTests());
+    assert(shortVerifierTests());
+    assert(traceTests());
+    assert(shardTests());
+    assert(dispatchTests());
+    assert(bulkCompileTests());
 }
 
 